@@ -1,13 +1,17 @@
 #include <time.h>
 #include <atomic>
+#include <cstdint>
 
+// Seconds since startup, in 32 bits, which lasts for 136 years.
 class timestamp
 {
 private:
-  std::atomic<time_t> t_;
+  std::atomic<uint32_t> t_;
+  static time_t epoch() { static const time_t e = time(NULL); return e; }
+  static uint32_t relative() { return now() - epoch(); }
 public:
   static time_t now() { return time(NULL); }
-  timestamp() : t_(now()) { }
-  void update() { t_ = now(); }
-  operator time_t () const { return t_.load(); }
+  timestamp() : t_(relative()) { }
+  void update() { t_ = relative(); }
+  operator time_t () const { return epoch() + t_.load(); }
 };
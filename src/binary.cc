@@ -9,13 +9,33 @@
 #include <cassert>
 #include <cstdarg>
 #include <cstring>
+#include <new>
+#include <string>
 
+#include <endian.h>
 #include <boost/asio.hpp>
 
+// Requests with a longer key, extras or body (besides a stored value)
+// are refused, so a request always fits in the input buffer.
 constexpr int buffer_size = 4096;
+constexpr int max_key_size = 250;
+// Values up to this size are copied into the output buffer, larger
+// ones sent from where they are.
+constexpr size_t copy_max = 1024;
+// Room for the largest response but stats and values sent by reference.
+constexpr int response_max = 512;
+// As in the text protocol: responses are collected until the input
+// runs out, or until this little room is left or this many value
+// bytes are waiting.
+constexpr int pipeline_room = 1024;
+constexpr size_t pipeline_ref_max = 1 << 20;
+// Gets whose keys are prefetched together.
+constexpr int get_batch = 16;
+constexpr uint8_t binary_response_magic = 0x81;
 
 using namespace std;
 
+// All fields are in network byte order on the wire.
 struct request_header
 {
   uint8_t magic;
@@ -26,6 +46,7 @@ struct request_header
   uint16_t vbucket_id;
   uint32_t total_body_length;
   uint32_t opaque;
+  uint64_t cas;
 } __attribute__((packed));
 
 struct response_header
@@ -33,18 +54,143 @@ struct response_header
   uint8_t magic;
   uint8_t opcode;
   uint16_t key_length;
-  uint8_t entras_length;
+  uint8_t extras_length;
   uint8_t data_type;
   uint16_t status;
   uint32_t total_body_length;
   uint32_t opaque;
+  uint64_t cas;
 } __attribute__((packed));
 
+enum binary_opcode {
+  op_get = 0x00,
+  op_set = 0x01,
+  op_add = 0x02,
+  op_replace = 0x03,
+  op_delete = 0x04,
+  op_increment = 0x05,
+  op_decrement = 0x06,
+  op_quit = 0x07,
+  op_flush = 0x08,
+  op_getq = 0x09,
+  op_noop = 0x0a,
+  op_version = 0x0b,
+  op_getk = 0x0c,
+  op_getkq = 0x0d,
+  op_append = 0x0e,
+  op_prepend = 0x0f,
+  op_stat = 0x10,
+  op_setq = 0x11,
+  op_addq = 0x12,
+  op_replaceq = 0x13,
+  op_deleteq = 0x14,
+  op_incrementq = 0x15,
+  op_decrementq = 0x16,
+  op_quitq = 0x17,
+  op_flushq = 0x18,
+  op_appendq = 0x19,
+  op_prependq = 0x1a,
+  op_verbosity = 0x1b,
+  op_touch = 0x1c,
+  op_gat = 0x1d,
+  op_gatq = 0x1e,
+  op_gatk = 0x23,
+  op_gatkq = 0x24,
+};
+
+enum binary_status {
+  status_ok = 0x00,
+  status_key_enoent = 0x01,
+  status_key_eexists = 0x02,
+  status_einval = 0x04,
+  status_not_stored = 0x05,
+  status_delta_badval = 0x06,
+  status_unknown_command = 0x81,
+  status_enomem = 0x82,
+};
+
+const char *
+status_message(binary_status s)
+{
+  switch (s) {
+  case status_ok:              return "";
+  case status_key_enoent:      return "Not found";
+  case status_key_eexists:     return "Data exists for key.";
+  case status_einval:          return "Invalid arguments";
+  case status_not_stored:      return "Not stored.";
+  case status_delta_badval:    return "Incr/Decr on non-numeric value";
+  case status_unknown_command: return "Unknown command";
+  case status_enomem:          return "Out of memory";
+  }
+  return "Unknown error";
+}
+
+// The quiet opcode's loud version, or op itself. Quiet requests are
+// only answered when they fail, or, for gets, when they hit.
+uint8_t
+loud_opcode(uint8_t op)
+{
+  switch (op) {
+  case op_getq:       return op_get;
+  case op_getkq:      return op_getk;
+  case op_setq:       return op_set;
+  case op_addq:       return op_add;
+  case op_replaceq:   return op_replace;
+  case op_deleteq:    return op_delete;
+  case op_incrementq: return op_increment;
+  case op_decrementq: return op_decrement;
+  case op_quitq:      return op_quit;
+  case op_flushq:     return op_flush;
+  case op_appendq:    return op_append;
+  case op_prependq:   return op_prepend;
+  case op_gatq:       return op_gat;
+  case op_gatkq:      return op_gatk;
+  }
+  return op;
+}
+
+// Whether the request's value is read into a mem rather than the
+// input buffer.
+bool
+stores_value(uint8_t op)
+{
+  switch (loud_opcode(op)) {
+  case op_set: case op_add: case op_replace:
+  case op_append: case op_prepend:
+    return true;
+  }
+  return false;
+}
+
+bool
+is_get(uint8_t op)
+{
+  op = loud_opcode(op);
+  return op == op_get || op == op_getk;
+}
+
+/* binary session state transitions:
+ *
+ * read_command -> execute_command -+-(set/add/etc.)-> execute_write
+ *      ^               ^           |                       |
+ *      |               |      (buffer full)                |
+ *      |               |           v                       |
+ *      |               +------ write_data                  |
+ *      |                                                   v
+ *      +-------------------- write_result <----------------+
+ *
+ * Like the text session, write_result only flushes when the output is
+ * nearly full, and read_command when no complete request is left.
+ * Quit and IO errors cause the session to stop. A value which can't be
+ * stored for lack of memory is skipped (skip_data) before write_result.
+ */
+
 enum binary_state {
   binary_read_command,                 // Reading the next command
   binary_execute_command,              // Execute the command or reading set data
   binary_execute_write,                // Execute the set/add/etc. command
-  binary_write_data,
+  binary_write_data,                   // Sending a full buffer mid-command
+  binary_skip_data,                    // Discarding set data
   binary_write_result,
   binary_stopping,
 };
@@ -57,19 +203,20 @@ operator<<(ostream &o, binary_state s)
   case binary_execute_command: return o << "execute_command";
   case binary_execute_write:   return o << "execute_write";
   case binary_write_data:      return o << "write_data";
+  case binary_skip_data:       return o << "skip_data";
   case binary_write_result:    return o << "write_result";
   case binary_stopping:        return o << "stopping";
   }
   return o << "binary_state(" << (int)s << ")";
 }
 
-class binary_session : public session
+class binary_session : public session, private stats_sink
 {
   // session lifetime state
   boost::asio::io_service &io_service_; // ASIO handle
-  //cache &money;                        // cache handle
-  //stream &in;                          // session input stream
-  //stream &out;                         // session output stream
+  cache &money;                         // cache handle
+  stream &in;                           // session input stream
+  stream &out;                          // session output stream
   ostream &log_;
   session_done done_;           // Callback when session stops
 
@@ -82,28 +229,92 @@ class binary_session : public session
     [this](boost::system::error_code ec, size_t bytes) -> size_t {
     return cmd_callback(ec, bytes);
   };
+  function<void (boost::system::error_code, size_t)> cmd_done_ =
+    [this](boost::system::error_code ec, size_t bytes) -> void {
+    cmd_done(ec, bytes);
+  };
+  function<void (boost::system::error_code, size_t)> write_done_ =
+    [this](boost::system::error_code ec, size_t bytes) -> void {
+    write_done(ec, bytes);
+  };
+  function<void (boost::system::error_code, size_t)> skip_done_ =
+    [this](boost::system::error_code ec, size_t bytes) -> void {
+    skip_done(ec, bytes);
+  };
 
   buffer ibuf_;                 // Input buffer (current command)
-  request_header *current_;
+  buffer obuf_;                 // Staged output
+  // What flush() writes, as in the text session.
+  std::vector<boost::asio::const_buffer> iov_;
+  int ofrag_ = 0;
+  size_t oref_bytes_ = 0;
+  std::vector<const mem *> pins_;
+  std::string ostats_;          // stat responses, sent by reference
+
+  // Current command state, header in host byte order
+  request_header current_;
+  bool quiet_;
+  bool cmd_found_;
+  bool bad_request_;
   binary_state state_;
+  buf extras_;
+  buf key_;
+  buf value_;                   // unless stores_value()
+  mem *idata_ = nullptr;
+  size_t skip_;                 // set data left to discard
+  int prefetched_ = 0;          // gets ahead whose keys were prefetched
 
   void set_state(binary_state next);
-  
+
+  // Input
+  bool recv_command();
+  bool recv_data();
+  bool skip_data();
+  size_t request_size(const request_header &h) const;
+
+  // Output
+  void send_n(const void *p, size_t bytes);
+  void send_ref(buf b);
+  void send_header(binary_status status, size_t extras, size_t key,
+                   size_t value, uint64_t cas);
+  void send_status(binary_status status);
+  void send_cache_result(cache_error_t res, binary_status set_error);
+  using stats_sink::stat;
+  void stat(const char *name, const char *val) override;
+  void end_fragment();
+  void reset_output();
+  void release_data();
+  bool flush();
+  bool output_full() const;
+
+  // Command handlers
+  bool get();
+  bool del();
+  bool incr_decr(bool incr);
+  bool touch();
+  bool flush_all();
+  bool stats();
+  bool quit();
+  void prefetch_gets();
+
   void callback(boost::system::error_code ec, size_t bytes);
   size_t cmd_callback(boost::system::error_code ec, size_t bytes);
+  void cmd_done(boost::system::error_code ec, size_t bytes);
+  void write_done(boost::system::error_code ec, size_t bytes);
+  void skip_done(boost::system::error_code ec, size_t bytes);
   bool cmd_ready(size_t additional);
   void loop();
 
+  bool well_formed() const;
+  bool dispatch();
+  bool dispatch_write();
+
 public:
-  /*
   binary_session(boost::asio::io_service &io_service, class cache &c,
-           stream &in, stream &out, ostream &log)
-    : io_service_(io_service), money(c), in(in), out(out), log(log) { }
-  */
-  binary_session(boost::asio::io_service &io_service, class cache &,
-                 stream &, stream &, ostream &log)
-    : io_service_(io_service), log_(log), ibuf_(buffer_size) { }
-  ~binary_session() { }
+                 stream &in, stream &out, ostream &log)
+    : io_service_(io_service), money(c), in(in), out(out), log_(log),
+      ibuf_(buffer_size), obuf_(buffer_size) { }
+  ~binary_session() { release_data(); }
   void interact(session_done done);
 };
 
@@ -114,16 +325,570 @@ binary_session::set_state(binary_state next)
   state_ = next;
 }
 
+void
+binary_session::send_n(const void *p, size_t bytes)
+{
+  obuf_.write((const char *)p, bytes);
+}
+
+void
+binary_session::end_fragment()
+{
+  if (obuf_.used() > ofrag_) {
+    iov_.emplace_back(obuf_.headp() + ofrag_, obuf_.used() - ofrag_);
+    ofrag_ = obuf_.used();
+  }
+}
+
+// Send b from where it is. It must stay put until the write is done.
+void
+binary_session::send_ref(buf b)
+{
+  end_fragment();
+  iov_.emplace_back(b.headp(), b.size());
+  oref_bytes_ += b.size();
+}
+
+void
+binary_session::reset_output()
+{
+  obuf_.reset();
+  ofrag_ = 0;
+  oref_bytes_ = 0;
+  ostats_.clear();
+}
+
+void
+binary_session::release_data()
+{
+  for (const mem *m : pins_)
+    mem_unpin(m);
+  pins_.clear();
+}
+
+bool
+binary_session::output_full() const
+{
+  return obuf_.available() < pipeline_room ||
+    oref_bytes_ >= pipeline_ref_max || !ostats_.empty();
+}
+
+bool
+binary_session::flush()
+{
+  end_fragment();
+  if (iov_.empty())
+    return false;
+  out.async_write(iov_, write_done_);
+  return true;
+}
+
+void
+binary_session::send_header(binary_status status, size_t extras, size_t key,
+                            size_t value, uint64_t cas)
+{
+  response_header h;
+  h.magic = binary_response_magic;
+  h.opcode = current_.opcode;
+  h.key_length = htobe16(key);
+  h.extras_length = extras;
+  h.data_type = 0;
+  h.status = htobe16(status);
+  h.total_body_length = htobe32(extras + key + value);
+  h.opaque = current_.opaque;
+  h.cas = htobe64(cas);
+  send_n(&h, sizeof(h));
+}
+
+// A reply without extras, key or value, but an error's message.
+void
+binary_session::send_status(binary_status status)
+{
+  if (status == status_ok && quiet_)
+    return;
+  const char *msg = status_message(status);
+  size_t n = strlen(msg);
+  send_header(status, 0, 0, n, 0);
+  send_n(msg, n);
+}
+
+// set_error is what the command calls not storing the value.
+void
+binary_session::send_cache_result(cache_error_t res, binary_status set_error)
+{
+  switch (res) {
+  case cache_error_t::stored:
+  case cache_error_t::deleted:
+    // XXX - the cache doesn't tell us a stored value's version, so
+    // there's no cas
+    send_status(status_ok);
+    break;
+  case cache_error_t::notfound:
+    send_status(status_key_enoent);
+    break;
+  case cache_error_t::set_error:
+    send_status(set_error);
+    break;
+  case cache_error_t::cas_exists:
+    send_status(status_key_eexists);
+    break;
+  case cache_error_t::not_numeric:
+    send_status(status_delta_badval);
+    break;
+  }
+  set_state(binary_write_result);
+}
+
+// Consecutive gets are looked up the way cache::get_many() does: the
+// first prefetches the buckets of the following ones already read.
+void
+binary_session::prefetch_gets()
+{
+  const char *p = ibuf_.headp();
+  const char *end = p + ibuf_.used();
+  int n = 0;
+  while (n < get_batch && end - p >= (ssize_t)sizeof(request_header)) {
+    request_header h;
+    memcpy(&h, p, sizeof(h));
+    size_t body = be32toh(h.total_body_length);
+    size_t key = be16toh(h.key_length);
+    if (!is_get(h.opcode) || end - p < (ssize_t)(sizeof(h) + body) ||
+        h.extras_length + key > body)
+      break;
+    money.prefetch(buf(p + sizeof(h) + h.extras_length, key));
+    p += sizeof(h) + body;
+    n++;
+  }
+  prefetched_ = n;
+}
+
+bool
+binary_session::get()
+{
+  if (prefetched_ > 0)
+    prefetched_--;
+  else
+    prefetch_gets();
+  uint8_t op = loud_opcode(current_.opcode);
+  cache::ref e = nullptr;
+  if (op == op_gat || op == op_gatk) {
+    uint32_t exptime;
+    memcpy(&exptime, extras_.headp(), sizeof(exptime));
+    if (money.touch(key_, be32toh(exptime)) == cache_error_t::stored)
+      e = money.get(key_);
+  } else {
+    e = money.get(key_);
+  }
+  set_state(binary_write_result);
+  if (e == nullptr) {
+    if (!quiet_)
+      send_status(status_key_enoent);
+    return false;
+  }
+
+  bool with_key = op == op_getk || op == op_gatk;
+  size_t keylen = with_key ? key_.size() : 0;
+  uint32_t flags = htobe32(e->get_flags());
+  uint64_t version = e->get_version();
+  const_rope data;
+  if (!e->read(&data)) {
+    if (!quiet_)
+      send_status(status_key_enoent);
+    return false;
+  }
+  size_t size = data.size();
+  send_header(status_ok, sizeof(flags), keylen, size, version);
+  send_n(&flags, sizeof(flags));
+  send_n(key_.headp(), keylen);
+  if (size <= copy_max && obuf_.available() > (int)size) {
+    while (!data.empty()) {
+      buf b = data.pop();
+      send_n(b.headp(), b.size());
+    }
+  } else if (const mem *m = data.head()) {
+    // The thread may checkpoint before the write is done.
+    mem_pin(m);
+    pins_.push_back(m);
+    while (!data.empty())
+      send_ref(data.pop());
+  } else {
+    // Inline, which response_max leaves room for.
+    buf b = data.pop();
+    send_n(b.headp(), b.size());
+  }
+  return false;
+}
+
+bool
+binary_session::del()
+{
+  // XXX - a cas isn't checked
+  send_cache_result(money.del(key_), status_not_stored);
+  return false;
+}
+
+bool
+binary_session::incr_decr(bool incr)
+{
+  uint64_t delta, initial;
+  uint32_t exptime;
+  memcpy(&delta, extras_.headp(), sizeof(delta));
+  memcpy(&initial, extras_.headp() + 8, sizeof(initial));
+  memcpy(&exptime, extras_.headp() + 16, sizeof(exptime));
+  delta = be64toh(delta);
+  initial = be64toh(initial);
+  exptime = be32toh(exptime);
+
+  uint64_t v;
+  cache_error_t res = incr ? money.incr(key_, delta, &v)
+    : money.decr(key_, delta, &v);
+  if (res == cache_error_t::set_error && exptime != 0xffffffff) {
+    // Create the counter, unless someone else just did. add() frees m
+    // if it fails.
+    char s[24];
+    int n = snprintf(s, sizeof(s), "%lu", initial);
+    mem *m = mem_alloc(n);
+    memcpy(m->data, s, n);
+    v = initial;
+    res = money.add(key_, 0, exptime, rope(m, m));
+    if (res != cache_error_t::stored)
+      res = incr ? money.incr(key_, delta, &v) : money.decr(key_, delta, &v);
+  }
+
+  set_state(binary_write_result);
+  if (res == cache_error_t::not_numeric) {
+    send_status(status_delta_badval);
+  } else if (res != cache_error_t::stored) {
+    send_status(status_key_enoent);
+  } else if (!quiet_) {
+    v = htobe64(v);
+    send_header(status_ok, 0, 0, sizeof(v), 0);
+    send_n(&v, sizeof(v));
+  }
+  return false;
+}
+
+bool
+binary_session::touch()
+{
+  uint32_t exptime;
+  memcpy(&exptime, extras_.headp(), sizeof(exptime));
+  send_cache_result(money.touch(key_, be32toh(exptime)), status_not_stored);
+  return false;
+}
+
+bool
+binary_session::flush_all()
+{
+  uint32_t delay = 0;
+  if (extras_.size() == sizeof(delay))
+    memcpy(&delay, extras_.headp(), sizeof(delay));
+  money.flush_all(be32toh(delay));
+  send_status(status_ok);
+  set_state(binary_write_result);
+  return false;
+}
+
+void
+binary_session::stat(const char *name, const char *val)
+{
+  size_t n = strlen(name), m = strlen(val);
+  response_header h = {};
+  h.magic = binary_response_magic;
+  h.opcode = current_.opcode;
+  h.key_length = htobe16(n);
+  h.total_body_length = htobe32(n + m);
+  h.opaque = current_.opaque;
+  ostats_.append((const char *)&h, sizeof(h));
+  ostats_.append(name, n);
+  ostats_.append(val, m);
+}
+
+// The responses go in ostats_, which can't move until they're sent, so
+// anything before them is sent first.
+bool
+binary_session::stats()
+{
+  if (flush()) {
+    set_state(binary_write_data);
+    return true;
+  }
+  if (key_.is("slabs")) {
+    report_slab_stats(*this);
+  } else if (key_.empty()) {
+    report_stats(money, *this);
+  } else {
+    // As memcached answers a group it doesn't know.
+    send_status(status_key_enoent);
+    set_state(binary_write_result);
+    return false;
+  }
+  ostats_.append(sizeof(response_header), '\0');
+  response_header *end = (response_header *)
+    &ostats_[ostats_.size() - sizeof(response_header)];
+  end->magic = binary_response_magic;
+  end->opcode = current_.opcode;
+  end->opaque = current_.opaque;
+  send_ref(buf(ostats_.data(), ostats_.size()));
+  set_state(binary_write_result);
+  return false;
+}
+
+bool
+binary_session::quit()
+{
+  send_status(status_ok);
+  set_state(binary_stopping);
+  return flush();
+}
+
+bool                            // XXX - we never block
+binary_session::dispatch_write()
+{
+  if (bad_request_) {
+    mem_free(idata_);
+    idata_ = nullptr;
+    send_status(status_einval);
+    set_state(binary_write_result);
+    return false;
+  }
+  rope data = rope(idata_, idata_);
+  uint32_t flags = 0, exptime = 0;
+  if (extras_.size() == 8) {
+    memcpy(&flags, extras_.headp(), sizeof(flags));
+    memcpy(&exptime, extras_.headp() + 4, sizeof(exptime));
+    flags = be32toh(flags);
+    exptime = be32toh(exptime);
+  }
+  switch (loud_opcode(current_.opcode)) {
+  case op_set:
+    if (current_.cas) {
+      send_cache_result(money.cas(key_, flags, exptime, current_.cas, data),
+                        status_not_stored);
+    } else {
+      send_cache_result(money.set(key_, flags, exptime, data),
+                        status_not_stored);
+    }
+    break;
+  case op_add:
+    send_cache_result(money.add(key_, flags, exptime, data),
+                      status_key_eexists);
+    break;
+  case op_replace:
+    send_cache_result(money.replace(key_, flags, exptime, data),
+                      status_key_enoent);
+    break;
+  case op_append:
+    send_cache_result(money.append(key_, data), status_not_stored);
+    break;
+  case op_prepend:
+    send_cache_result(money.prepend(key_, data), status_not_stored);
+    break;
+  default:
+    assert(0);
+  }
+  idata_ = nullptr;
+  return false;
+}
+
+// Whether the request has the extras, key and value its command takes.
+bool
+binary_session::well_formed() const
+{
+  size_t extras = extras_.size(), key = key_.size();
+  bool value = !value_.empty();
+  switch (loud_opcode(current_.opcode)) {
+  case op_get: case op_getk: case op_delete:
+    return extras == 0 && key > 0 && !value;
+  case op_set: case op_add: case op_replace:
+    return extras == 8 && key > 0;
+  case op_append: case op_prepend:
+    return extras == 0 && key > 0;
+  case op_increment: case op_decrement:
+    return extras == 20 && key > 0 && !value;
+  case op_touch: case op_gat: case op_gatk:
+    return extras == 4 && key > 0 && !value;
+  case op_flush:
+    return (extras == 0 || extras == 4) && key == 0 && !value;
+  case op_verbosity:
+    return extras == 4 && key == 0 && !value;
+  case op_stat:
+    return extras == 0 && !value;
+  case op_quit: case op_noop: case op_version:
+    return extras == 0 && key == 0 && !value;
+  }
+  return true;                  // unknown, which is answered as such
+}
+
+bool
+binary_session::dispatch()
+{
+  // The largest response but a stats reply or a referenced value.
+  if (obuf_.available() < response_max) {
+    set_state(binary_write_data);
+    return flush();
+  }
+
+  bad_request_ = key_.size() > max_key_size || !well_formed();
+  // A value is read even if the request is no good.
+  if (stores_value(current_.opcode))
+    return recv_data();
+  if (bad_request_) {
+    send_status(status_einval);
+    set_state(binary_write_result);
+    return false;
+  }
+
+  switch (loud_opcode(current_.opcode)) {
+  case op_get: case op_getk: case op_gat: case op_gatk:
+    return get();
+  case op_delete:
+    return del();
+  case op_increment:
+    return incr_decr(true);
+  case op_decrement:
+    return incr_decr(false);
+  case op_touch:
+    return touch();
+  case op_flush:
+    return flush_all();
+  case op_stat:
+    return stats();
+  case op_quit:
+    return quit();
+  case op_noop: case op_verbosity:
+    send_status(status_ok);
+    break;
+  case op_version: {
+    const char *v = PACKAGE_VERSION;
+    send_header(status_ok, 0, 0, strlen(v), 0);
+    send_n(v, strlen(v));
+    break;
+  }
+  default:
+    log_ << INFO << "unknown opcode: " << (int)current_.opcode << endl;
+    send_status(status_unknown_command);
+    break;
+  }
+  set_state(binary_write_result);
+  return false;
+}
+
+// Read the value of a set/add/etc. into idata_.
+bool
+binary_session::recv_data()
+{
+  size_t bytes = current_.total_body_length - extras_.size() - key_.size();
+  try {
+    idata_ = mem_alloc(bytes);     // XXX - memory chunk size
+  } catch (std::bad_alloc &) {
+    skip_ = bytes;
+    set_state(binary_skip_data);
+    return false;
+  }
+  size_t ready = min(bytes, (size_t)ibuf_.used());
+  memcpy(idata_->data, ibuf_.headp(), ready);
+  ibuf_.notify_read(ready);
+  set_state(binary_execute_write);
+  if (ready == bytes) {
+    return false;
+  } else {
+    in.async_read(boost::asio::mutable_buffers_1(idata_->data + ready,
+                                                 bytes - ready),
+                  boost::asio::transfer_exactly(bytes - ready),
+                  callback_);
+    return true;
+  }
+}
+
+// Read past the value of a request we're out of memory for, to the
+// next request.
+bool
+binary_session::skip_data()
+{
+  size_t n = min(skip_, (size_t)ibuf_.used());
+  ibuf_.notify_read(n);
+  skip_ -= n;
+  if (skip_ == 0) {
+    send_status(status_enomem);
+    set_state(binary_write_result);
+    return false;
+  }
+  ibuf_.reset();
+  size_t want = min(skip_, (size_t)ibuf_.available());
+  in.async_read(boost::asio::mutable_buffers_1(ibuf_.tailp(), want),
+                boost::asio::transfer_exactly(want), skip_done_);
+  return true;
+}
+
+// Bytes of the request which must be in the input buffer: its header,
+// extras and key, and its value unless that's read separately.
+size_t
+binary_session::request_size(const request_header &h) const
+{
+  size_t size = sizeof(h) + h.extras_length + h.key_length;
+  if (!stores_value(h.opcode))
+    size = sizeof(h) + h.total_body_length;
+  return size;
+}
+
 bool
 binary_session::cmd_ready(size_t additional)
 {
-  if (ibuf_.used() + additional < sizeof(request_header))
+  size_t used = ibuf_.used() + additional;
+  if (used < sizeof(request_header))
     return false;
-  current_ = (request_header*) ibuf_.headp();
+  request_header h;
+  memcpy(&h, ibuf_.headp(), sizeof(h));
+  h.key_length = be16toh(h.key_length);
+  h.vbucket_id = be16toh(h.vbucket_id);
+  h.total_body_length = be32toh(h.total_body_length);
+  h.cas = be64toh(h.cas);
+  size_t size = request_size(h);
+  if (h.magic != binary_request_magic ||
+      h.total_body_length < h.extras_length + h.key_length ||
+      size > (size_t)ibuf_.max_size()) {
+    // We can't make sense of the stream any more, so hang up.
+    cmd_found_ = true;
+    state_ = binary_stopping;
+    log_ << INFO << "bad request" << std::endl;
+    return true;
+  }
+  if (used < size)
+    return false;
+
   ibuf_.notify_write(additional);
+  current_ = h;
+  quiet_ = loud_opcode(h.opcode) != h.opcode;
+  ibuf_.notify_read(sizeof(h));
+  extras_ = ibuf_.sub(h.extras_length);
+  key_ = ibuf_.sub(h.key_length);
+  value_ = stores_value(h.opcode) ? buf() :
+    ibuf_.sub(h.total_body_length - h.extras_length - h.key_length);
+  cmd_found_ = true;
   return true;
 }
 
+bool
+binary_session::recv_command()
+{
+  cmd_found_ = false;
+  set_state(binary_execute_command);
+  if (cmd_ready(0)) {
+    return false;
+  } else if (flush()) {
+    // Answer the pipelined requests before waiting for more.
+    set_state(binary_read_command);
+    return true;
+  } else {
+    ibuf_.compact();
+    in.async_read(boost::asio::mutable_buffers_1(ibuf_.tailp(),
+                                                 ibuf_.available()),
+                  cmd_callback_, cmd_done_);
+    return true;
+  }
+}
+
 size_t
 binary_session::cmd_callback(boost::system::error_code ec, size_t bytes)
 {
@@ -133,6 +898,31 @@ binary_session::cmd_callback(boost::system::error_code ec, size_t bytes)
     return cmd_ready(bytes) ? 0 : ibuf_.available() - bytes;
 }
 
+void
+binary_session::cmd_done(boost::system::error_code ec, size_t bytes)
+{
+  if (!ec && !cmd_found_)
+    cmd_ready(bytes);
+  callback(ec, bytes);
+}
+
+void
+binary_session::skip_done(boost::system::error_code ec, size_t bytes)
+{
+  if (!ec)
+    ibuf_.notify_write(bytes);
+  callback(ec, bytes);
+}
+
+void
+binary_session::write_done(boost::system::error_code ec, size_t bytes)
+{
+  iov_.clear();
+  release_data();
+  reset_output();
+  callback(ec, bytes);
+}
+
 void
 binary_session::callback(boost::system::error_code ec, size_t bytes)
 {
@@ -146,27 +936,43 @@ binary_session::callback(boost::system::error_code ec, size_t bytes)
 void
 binary_session::loop()
 {
+  gc_unpark();
   bool blocked = false;
   while (not blocked) {
-    switch (state_) {
-    case binary_read_command:
-      continue;
-    case binary_execute_command:
-      assert(0);
-      continue;
-    case binary_execute_write:
-      assert(0);
-      continue;
-    case binary_write_data:
-      assert(0);
-      continue;
-    case binary_write_result:
-      assert(0);
+    try {
+      switch (state_) {
+      case binary_read_command:
+        blocked = recv_command();
+        continue;
+      case binary_execute_command:
+        blocked = dispatch();
+        continue;
+      case binary_execute_write:
+        blocked = dispatch_write();
+        continue;
+      case binary_write_data:
+        set_state(binary_execute_command);
+        continue;
+      case binary_skip_data:
+        blocked = skip_data();
+        continue;
+      case binary_write_result:
+        set_state(binary_read_command);
+        if (output_full())
+          blocked = flush();
+        continue;
+      case binary_stopping:
+        io_service_.dispatch(done_);
+        return;
+      }
+    } catch (std::bad_alloc &) {
+      // The cache has freed the value, if there was one.
+      idata_ = nullptr;
+      send_status(status_enomem);
+      set_state(binary_write_result);
       continue;
-    case binary_stopping:
-      io_service_.dispatch(done_);
-      return;
     }
+    assert(0);
   }
 }
 
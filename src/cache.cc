@@ -1,22 +1,33 @@
 #include "buffer.h"
 #include "cache.h"
 #include "murmur2.h"
+#include "numa.h"
+#include "dedup.h"
+#include "compress.h"
 
 #include <limits>
+#include <new>
 #include <algorithm>
 
-cache_key::cache_key(char *b, buf src) : buf(b, src.size())
+cache_key::cache_key(char *b, buf src)
+  : gc_object(gc_kind_of<cache_key>()), buf(b, src.size())
 {
   memcpy(b, src.headp(), src.size());
 }
 
-// Warning - placement new is being used here with vanilla
-// deletes. ie we are assuming delete just calls free().
+// Placement new is used here with vanilla deletes, which works since
+// gc_object's operator delete frees any slab chunk regardless of size.
 cache_key *
 cache_key::alloc(buf src)
 {
-  char *b = (char *)malloc(sizeof(cache_key) + src.size());
-  return new (b) cache_key(b + sizeof(cache_key), src);
+  return place(slab_alloc(alloc_size(src)), src);
+}
+
+cache_key *
+cache_key::place(void *p, buf src)
+{
+  char *b = (char *)p;
+  return ::new (b) cache_key(b + sizeof(cache_key), src);
 }
 
 static bool
@@ -33,46 +44,155 @@ key_hash(buf a, int seed)
   return MurmurHash64A(a.headp(), a.size(), seed);
 }
 
-static void
-key_release(cache::key *k)
+void
+cache::key_release(key *k)
 {
+  key_bytes_.sub(slab_usable_size(k));
   k->gc_free();
 }
 
 void
 cache::entry_release(entry *e)
 {
-  size_t size = 0;
   // XXX - seems wrong that we have to walk this
   for (entry *x = e; x; x = x->newer())
-    size += x->size();
-  bytes_.sub(size);
+    account(-(ssize_t)x->size(), -(ssize_t)x->footprint());
   e->gc_free();
 }
 
+void
+cache::account(ssize_t bytes, ssize_t footprint)
+{
+  bytes_.add(bytes);
+  overhead_.add(footprint - bytes);
+}
+
+void
+cache::account(const value_delta &d)
+{
+  account(d.bytes, d.footprint);
+}
+
+void
+cache::adopt_key(key *k)
+{
+  key_bytes_.add(slab_usable_size(k));
+}
+
 auto cache::new_table(int lg2size) -> table_t *
 {
   return new opentable<key, entry, buf>(lg2size, key_eq, key_hash,
-                                            key_release,
+                                            std::bind<void>(&cache::key_release, this,
+                                                            std::placeholders::_1),
                                             std::bind<void>(&cache::entry_release, this,
                                                             std::placeholders::_1));
 }
 
 cache::cache(size_t max_bytes) : max_bytes(max_bytes), flushed(0),
                                  _entries(new_table(initial_lg2size)),
-                                 _building(nullptr) { }
+                                 _building(nullptr),
+                                 collect_stage_(0),
+                                 collect_old_(nullptr) { }
+
+cache::key *
+cache::key_for(table_t *t, buf k, std::unique_ptr<key> &mykey,
+               std::unique_ptr<entry> &e,
+               unsigned flags, unsigned exptime, const rope &r)
+{
+  // Most sets overwrite an existing key, so try to reuse the key
+  // object already in the table before allocating our own.
+  key *cur = t->find_key(k);
+  e.reset(new_entry(flags, exptime, r, k, cur ? nullptr : &mykey));
+  return cur ? cur : mykey.get();
+}
+
+// An entry shares one chunk with its key, when mykey is given, and
+// with a small value not stored inline, so a get touches one or two
+// cache lines past the bucket instead of three scattered objects. The
+// chunk is freed once all of them are gone. Sharing is only used
+// where it costs no more memory than separate chunks; size class
+// rounding decides which of the layouts is cheapest.
+// XXX - a key outliving its entry keeps the whole chunk, and only its
+// own share of it is accounted.
+// A large value is first compressed and swapped for a shared copy,
+// when those are enabled. The value is freed if we run out of memory.
+entry *
+cache::new_entry(unsigned flags, unsigned exptime, const rope &v,
+                 buf k, std::unique_ptr<key> *mykey)
+{
+  std::unique_ptr<mem, void (*)(mem *)> owned(v.head(), mem_free);
+  mem *packed = compress_enabled() ?
+    compress_value(v.head(), v.tail()) : nullptr;
+  if (packed)
+    owned.reset(packed);
+  const rope c = packed ? rope(packed, packed) : v;
+  mem *shared = dedup_enabled() ? dedup_value(c.head(), c.tail()) : nullptr;
+  if (shared) {
+    owned.release();            // freed by dedup_value()
+    owned.reset(shared);
+  }
+  const rope r = shared ? rope(shared, shared) : c;
+  const bool inlined = entry::inlines(r);
+  size_t sizes[3] = { entry::alloc_size(r), 0, 0 };
+  int nobjs = 1;
+  if (mykey)
+    sizes[nobjs++] = key::alloc_size(k);
+  const int with_key = nobjs;
+  const size_t n = r.size();
+  sizes[nobjs++] = sizeof(mem) + n;
+
+  const size_t value = inlined ? 0 : mem_footprint(r.head(), r.tail());
+  size_t apart = slab_good_size(sizes[0]) + value;
+  if (mykey)
+    apart += slab_good_size(sizes[1]);
+  size_t key_shared = mykey ?
+    slab_good_size(slab_shared_size(sizes, with_key)) + value : apart + 1;
+  // Log storage wants values in segments, and a deduplicated value
+  // must stay where it is.
+  size_t all_shared = !inlined && r.head() == r.tail() &&
+    !segment_enabled() && !shared && slab_shared_size(sizes, nobjs) <= compact_max ?
+    slab_good_size(slab_shared_size(sizes, nobjs)) : apart + 1;
+
+  void *objs[3];
+  if (all_shared <= std::min(apart, key_shared)) {
+    slab_alloc_shared(sizes, nobjs, objs);
+    mem *m = mem_init(objs[nobjs - 1], n);
+    memcpy(m->data, r.head()->data, n);
+    if (packed) {
+      m->flags |= mem_flag_compressed;
+      compress_account(m, 1);
+    }
+    owned.reset();
+    if (mykey)
+      mykey->reset(key::place(objs[1], k));
+    return entry::place(objs[0], flags, exptime, rope(m, m));
+  }
+  if (key_shared <= apart) {
+    slab_alloc_shared(sizes, with_key, objs);
+    owned.release();
+    mykey->reset(key::place(objs[1], k));
+    return entry::place(objs[0], flags, exptime, r);
+  }
+  if (mykey)
+    mykey->reset(key::alloc(k));
+  entry *e = entry::alloc(flags, exptime, r);
+  owned.release();
+  return e;
+}
 
 cache_error_t
 cache::set(buf k, unsigned flags, unsigned exptime, const rope &r)
 {
   sets_.incr();
-  std::unique_ptr<key> mykey(key::alloc(k));
-  std::unique_ptr<entry> e(new entry(flags, exptime, r));
+  std::unique_ptr<key> mykey;
+  std::unique_ptr<entry> e;
   key *cur_key;
   table_t *entries, *building;
-  if (is_building(&entries, &building)) {
+  bool is_b = is_building(&entries, &building);
+  key *k_ref = key_for(entries, k, mykey, e, flags, exptime, r);
+  if (is_b) {
     entry *cur_entry;
-    if (entries->add(mykey.get(), e.get(), &cur_key, &cur_entry)) {
+    if (entries->add(k_ref, e.get(), &cur_key, &cur_entry)) {
       building->set_shared(cur_key, cur_entry);
     } else if (cur_entry) {
       cur_entry->mv_set(e.get());
@@ -81,15 +201,15 @@ cache::set(buf k, unsigned flags, unsigned exptime, const rope &r)
       assert(cur_key == nullptr);
     }
   } else {
-    cur_key = entries->set(mykey.get(), e.get());
+    cur_key = entries->set(k_ref, e.get());
   }
 
   if (mykey.get() == cur_key)
-    mykey.release();
+    adopt_key(mykey.release());
   if (cur_key == nullptr)
     return cache_error_t::set_error;
 
-  bytes_.add(r.size());
+  account(e->size(), e->footprint());
   e.release();
   return cache_error_t::stored;
 }
@@ -98,31 +218,41 @@ cache_error_t
 cache::add(buf k, unsigned flags, unsigned exptime, const rope &r)
 {
   sets_.incr();
-  std::unique_ptr<key> mykey(key::alloc(k));
-  std::unique_ptr<entry> e(new entry(flags, exptime, r));
+  table_t *entries, *building;
+  bool is_b = is_building(&entries, &building);
+
+  // Fail early, without allocating, if the key is obviously present.
+  entry *cur = entries->find(k);
+  if (cur != nullptr && (!is_b || cur->newest() != nullptr)) {
+    mem_free(r.head());
+    return cache_error_t::set_error;
+  }
+
+  std::unique_ptr<key> mykey;
+  std::unique_ptr<entry> e;
+  key *k_ref = key_for(entries, k, mykey, e, flags, exptime, r);
 
   key *cur_key;
-  table_t *entries, *building;
   bool success;
-  if (is_building(&entries, &building)) {
+  if (is_b) {
     entry *cur_entry;
-    success = entries->add(mykey.get(), e.get(), &cur_key, &cur_entry);
+    success = entries->add(k_ref, e.get(), &cur_key, &cur_entry);
     if (success) {
       building->add_shared(cur_key, cur_entry, NULL, NULL);
-    } else {
+    } else if (cur_entry) {
       success = cur_entry->mv_add(e.get());
     }
   } else {
-    success = entries->add(mykey.get(), e.get(), &cur_key, NULL);
+    success = entries->add(k_ref, e.get(), &cur_key, NULL);
   }
 
   if (mykey.get() == cur_key)
-    mykey.release();
+    adopt_key(mykey.release());
 
   if (!success)
     return cache_error_t::set_error;
 
-  bytes_.add(r.size());
+  account(e->size(), e->footprint());
   e.release();
   return cache_error_t::stored;
 }
@@ -132,17 +262,23 @@ cache::replace(buf k, unsigned flags,
                unsigned exptime, const rope &r)
 {
   sets_.incr();
-  std::unique_ptr<entry> e(new entry(flags, exptime, r));
   table_t *entries;
-  if (is_building(&entries, NULL)) {
-    entry *cur = entries->find(k);
-    if (!cur || !cur->mv_replace(e.get()))
+  bool is_b = is_building(&entries, NULL);
+  entry *cur = entries->find(k);
+  if (cur == nullptr) {
+    mem_free(r.head());
+    return cache_error_t::set_error;
+  }
+
+  std::unique_ptr<entry> e(new_entry(flags, exptime, r, k, nullptr));
+  if (is_b) {
+    if (!cur->mv_replace(e.get()))
       return cache_error_t::set_error;
   } else {
     if (!entries->replace(k, e.get()))
       return cache_error_t::set_error;
   }
-  bytes_.add(r.size());
+  account(e->size(), e->footprint());
   e.release();
   return cache_error_t::stored;
 }
@@ -153,6 +289,9 @@ cache::get(buf k)
   gets_.incr();
   entry *e = _entries.load()->find(k);
   if (e) {
+    // Sample where hits are served from.
+    if (numa_enabled() && (gets_ & numa_sample_mask) == 0)
+      numa_count_read(slab_node_of(e));
     return e->newest();
   } else {
     get_misses_.incr();
@@ -160,6 +299,22 @@ cache::get(buf k)
   }
 }
 
+void
+cache::prefetch(buf k)
+{
+  _entries.load()->prefetch(k);
+}
+
+void
+cache::get_many(const buf *keys, size_t n, ref *refs)
+{
+  table_t *t = _entries.load();
+  for (size_t i = 0; i < n; ++i)
+    t->prefetch(keys[i]);
+  for (size_t i = 0; i < n; ++i)
+    refs[i] = get(keys[i]);
+}
+
 cache_error_t
 cache::del(buf k)
 {
@@ -179,10 +334,14 @@ cache_error_t
 cache::append(buf key, const rope &suffix)
 {
   ref e = _entries.load()->find(key);
-  if (e == nullptr)
+  if (e == nullptr) {
+    mem_free(suffix.head());
     return cache_error_t::set_error;
-  bytes_.add(suffix.size());
-  e->append(suffix);
+  }
+  value_delta d;
+  e->append(suffix, &d);
+  account(d);
+  coalesce(e, max_segments);
   return cache_error_t::stored;
 }
 
@@ -190,21 +349,54 @@ cache_error_t
 cache::prepend(buf key, const rope &prefix)
 {
   ref e = get(key);
-  if (e == nullptr)
+  if (e == nullptr) {
+    mem_free(prefix.head());
     return cache_error_t::set_error;
-  bytes_.add(prefix.size());
-  e->prepend(prefix);
+  }
+  value_delta d;
+  e->prepend(prefix, &d);
+  account(d);
+  coalesce(e, max_segments);
   return cache_error_t::stored;
 }
 
+// Coalescing and relocation are skipped when out of memory.
+void
+cache::coalesce(entry *e, uint32_t threshold)
+{
+  value_delta d;
+  try {
+    if (e->get_segments() > threshold && e->coalesce(&d)) {
+      coalesces_.incr();
+      account(d);
+    }
+  } catch (std::bad_alloc &) {
+  }
+}
+
+void
+cache::relocate(entry *e)
+{
+  value_delta d;
+  try {
+    if (e->relocate(&d)) {
+      relocations_.incr();
+      account(d);
+    }
+  } catch (std::bad_alloc &) {
+  }
+}
+
 cache_error_t
 cache::incr(buf k, uint64_t v, uint64_t *vout)
 {
   ref e = get(k);
   if (e == nullptr)
     return cache_error_t::set_error;
-  *vout = e->incr(v);
-  return cache_error_t::stored;
+  value_delta d;
+  bool numeric = e->incr(v, &d, vout);
+  account(d);
+  return numeric ? cache_error_t::stored : cache_error_t::not_numeric;
 }
 
 cache_error_t
@@ -213,20 +405,28 @@ cache::decr(buf k, uint64_t v, uint64_t *vout)
   ref e = get(k);
   if (e == nullptr)
     return cache_error_t::set_error;
-  *vout = e->decr(v);
-  return cache_error_t::stored;
+  value_delta d;
+  bool numeric = e->decr(v, &d, vout);
+  account(d);
+  return numeric ? cache_error_t::stored : cache_error_t::not_numeric;
 }
 
 cache_error_t
 cache::cas(buf k, uint32_t flags, uint32_t exptime,
            uint64_t ver, const rope &r)
 {
+  // XXX - not compressed or deduplicated
   ref e = get(k);
-  if (e == nullptr)
+  if (e == nullptr) {
+    mem_free(r.head());
     return cache_error_t::notfound;
-  // XXX - update bytes
-  if (!e->cas(flags, exptime, ver, r))
+  }
+  value_delta d;
+  if (!e->cas(flags, exptime, ver, r, &d)) {
+    mem_free(r.head());
     return cache_error_t::cas_exists;
+  }
+  account(d);
   return cache_error_t::stored;
 }
 
@@ -241,10 +441,18 @@ cache::touch(buf k, unsigned exptime)
   return cache_error_t::stored;
 }
 
+size_t
+cache::excess_bytes() const
+{
+  size_t target = max_bytes * (1.0 - reserve_percentage);
+  size_t used = item_bytes();
+  return used > target ? used - target : 0;
+}
+
 time_t
 cache::get_atime_cutoff(const table_t &t) const
 {
-  const double p = (max_bytes * (1.0 - reserve_percentage)) / bytes_;
+  const double p = (max_bytes * (1.0 - reserve_percentage)) / item_bytes();
   if (p >= 1.0)
     return 0;
 
@@ -281,41 +489,102 @@ cache::entry_is_live(entry &e, const time_t &cutoff,
   return true;
 }
 
+// Publish a bigger table for operations to add to while the old
+// one is copied, once everyone sees it.
 void
-cache::collect()
+cache::collect_begin()
 {
   table_t *old = _entries.load();
   int new_lg2size = old->lg2size();
   if (old->usage() >= old->size() * usage_grow_threshold)
     new_lg2size++;
-  table_t *building = new_table(new_lg2size);
-  _building = building;
-  gc_flush();
+  _building = new_table(new_lg2size);
+  collect_old_ = old;
+}
 
+void
+cache::collect_copy()
+{
   // everyone now should see building
+  table_t *old = collect_old_;
+  table_t *building = _building.load();
   time_t now = timestamp::now();
+  bool log = segment_enabled();
+  // With log storage, values in segments are evicted by segment, and
+  // the rest (too large for a segment, or deduplicated) by atime as
+  // usual. Each takes its share of the excess.
+  if (log) {
+    double used = item_bytes();
+    double in_segments = segment_get_stats().live_bytes;
+    if (used > 0)
+      segment_select(excess_bytes() * std::min(in_segments / used, 1.0));
+  }
   time_t cutoff = get_atime_cutoff(*old);
   for (table_t::const_iterator i = old->cbegin(); i != old->cend(); ++i) {
     auto pair = *i;
     entry *c = pair.second;
-    if (c && entry_is_live(*c, cutoff, now))
-      building->add_shared(pair.first, pair.second, NULL, NULL);
+    if (c == nullptr)
+      continue;
+    entry *n = c->newest();
+    segment_state where = log ? n->placement() : segment_state::none;
+    if (!entry_is_live(*c, where == segment_state::none ? cutoff : 0, now))
+      continue;
+    if (where == segment_state::evicting) {
+      log_evictions_.incr();
+      continue;
+    }
+    if (where == segment_state::cleaning)
+      relocate(n);
+    else
+      coalesce(n, coalesce_segments);
+    building->add_shared(pair.first, pair.second, NULL, NULL);
   }
   _entries = building;
   _building = nullptr;
-  gc_flush();
+}
+
+void
+cache::collect_finish()
+{
   // everyone now should see building is nullptr, not be using old
   // XXX - we could be more efficient here
+  table_t *old = collect_old_;
+  table_t *building = _entries.load();
   for (table_t::iterator i = old->begin(); i != old->end(); ++i) {
     table_t::bucket_ref b = *i;
     building->exclusive(b.key(), b.value());
     b.reset();
   }
   delete old;
+  collect_old_ = nullptr;
   // compress....
 }
 
-bool cache::is_building(table_t **entries, table_t **building)
+bool
+cache::collect_step()
+{
+  switch (collect_stage_++) {
+  case 0:
+    collect_begin();
+    return true;
+  case 1:
+    collect_copy();
+    return true;
+  default:
+    collect_finish();
+    collect_stage_ = 0;
+    return false;
+  }
+}
+
+void
+cache::collect()
+{
+  while (collect_step())
+    gc_flush();
+}
+
+bool cache::is_building(table_t **entries, table_t **building) const
 {
   table_t *e = _entries.load();
   table_t *b = _building.load();
@@ -331,6 +600,40 @@ size_t cache::bytes() const
   return bytes_;
 }
 
+size_t cache::key_bytes() const
+{
+  return key_bytes_;
+}
+
+// Deduplicated values are counted in bytes_ once per item, but their
+// memory only once, and compressed values at their uncompressed size,
+// so overhead_ alone may be negative.
+size_t cache::overhead_bytes() const
+{
+  ssize_t n = overhead_ + (ssize_t)dedup_get_stats().footprint;
+  return std::max(n, (ssize_t)0);
+}
+
+size_t cache::item_bytes() const
+{
+  return std::max((ssize_t)bytes() + (ssize_t)key_bytes() + overhead_ +
+                  (ssize_t)dedup_get_stats().footprint, (ssize_t)0);
+}
+
+size_t cache::table_bytes() const
+{
+  table_t *entries, *building;
+  size_t n = 0;
+  if (is_building(&entries, &building))
+    n += building->bytes();
+  return n + entries->bytes();
+}
+
+size_t cache::max_item_bytes() const
+{
+  return max_bytes;
+}
+
 size_t cache::set_count() const
 {
   return sets_;
@@ -351,6 +654,21 @@ size_t cache::flush_count() const
   return flushes_;
 }
 
+size_t cache::coalesce_count() const
+{
+  return coalesces_;
+}
+
+size_t cache::relocation_count() const
+{
+  return relocations_;
+}
+
+size_t cache::log_eviction_count() const
+{
+  return log_evictions_;
+}
+
 size_t cache::get_miss_count() const
 {
   return get_misses_;
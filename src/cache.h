@@ -16,13 +16,19 @@ enum class cache_error_t
   notfound,
   set_error,
   cas_exists,
+  not_numeric,                  // incr or decr of a non-numeric value
 };
 
-class cache_key : public buf, public gc_object
+// gc_object first, so it starts the chunk and slab_usable_size() works
+// on it.
+class cache_key : public gc_object, public buf
 {
   cache_key(char *b, buf src);
 public:
   static cache_key *alloc(buf src);
+  // Construct in memory of alloc_size() bytes.
+  static cache_key *place(void *p, buf src);
+  static size_t alloc_size(buf src) { return sizeof(cache_key) + src.size(); }
 };
 
 class cache
@@ -36,6 +42,12 @@ private:
   static constexpr double usage_grow_threshold = 0.75; // cf. wikipedia
   static constexpr double reserve_percentage = 0.10;
   static constexpr int sample_size = 8192;
+  // Fragmented values are coalesced by collect() past the first
+  // threshold, and immediately by append/prepend past the second.
+  static constexpr uint32_t coalesce_segments = 8;
+  static constexpr uint32_t max_segments = 128;
+  // Largest chunk a value is copied into to share it with its entry.
+  static constexpr size_t compact_max = 2048;
   const size_t max_bytes;
   time_t flushed;               // XXX - atomic
 
@@ -44,25 +56,57 @@ private:
   std::atomic<table_t *> _building;
 
   table_t *new_table(int lg2size);
+  key *key_for(table_t *t, buf k, std::unique_ptr<key> &mykey,
+                std::unique_ptr<entry> &e,
+                unsigned flags, unsigned exptime, const rope &r);
+  entry *new_entry(unsigned flags, unsigned exptime, const rope &r,
+                   buf k, std::unique_ptr<key> *mykey);
+  void adopt_key(key *k);
+  void key_release(key *k);
   void entry_release(entry *e);
+  void account(ssize_t bytes, ssize_t footprint);
+  void account(const value_delta &d);
 
-  bool is_building(table_t **entries, table_t **building);
+  bool is_building(table_t **entries, table_t **building) const;
+  size_t excess_bytes() const;   // over the -m limit, less reserve
   time_t get_atime_cutoff(const table_t &t) const;
   // XXX - entry& should be const
   bool entry_is_live(entry &e, const time_t &cutoff, const time_t &now) const;
 
-  counter bytes_;
+  counter bytes_;                // value payload
+  counter key_bytes_;            // keys, as allocated
+  counter overhead_;             // entries, mem headers and slab slack
   counter sets_;
   counter gets_;
   counter touches_;
   counter flushes_;
   counter get_misses_;
+  counter coalesces_;
+  counter relocations_;          // values moved out of cleaned segments
+  counter log_evictions_;        // items dropped with evicted segments
+
+  void coalesce(entry *e, uint32_t threshold);
+  void relocate(entry *e);
+
+  // collect_step() state: the next stage, and the table it replaces.
+  int collect_stage_;
+  table_t *collect_old_;
+  void collect_begin();
+  void collect_copy();
+  void collect_finish();
 
 public:
 
   cache(size_t max_bytes);
   virtual ~cache() { delete _entries.load(); }
+  // Writes take the value passed to them, and free it if they fail.
+  // Operations throw std::bad_alloc once the slab region is used up,
+  // still freeing the value.
   ref get(buf k);
+  // get() each of n keys into refs, overlapping the lookups.
+  void get_many(const buf *keys, size_t n, ref *refs);
+  // Start loading k's bucket, for a get coming shortly.
+  void prefetch(buf k);
   cache_error_t set(buf k, unsigned flags,
                     unsigned exptime, const rope &r);
   cache_error_t add(buf k, unsigned flags,
@@ -79,7 +123,17 @@ public:
   cache_error_t touch(buf k, unsigned exptime);
   void flush_all(int delay);
 
+  // Memory use. The -m limit applies to item_bytes(), the sum of
+  // payload, key and overhead bytes. A deduplicated value's payload
+  // counts once per item, its memory once, and a compressed value's
+  // payload at its uncompressed size, so the overhead is reduced by
+  // what sharing and compression save.
   size_t bytes() const;
+  size_t key_bytes() const;
+  size_t overhead_bytes() const;
+  size_t item_bytes() const;
+  size_t table_bytes() const;
+  size_t max_item_bytes() const;
   size_t buckets() const;
   size_t keys() const;
   size_t get_count() const;
@@ -88,8 +142,15 @@ public:
   size_t set_count() const;
   size_t touch_count() const;
   size_t flush_count() const;
+  size_t coalesce_count() const;
+  size_t relocation_count() const;
+  size_t log_eviction_count() const;
 
   // Garbage collect old entries. Can be called concurrently with
   // other operations.
   void collect();
+  // The same in stages, for a caller with other things to do while
+  // every thread catches up between them: returns true when there's
+  // another, to be run once gc_flush_async() calls back.
+  bool collect_step();
 };
@@ -1,7 +1,16 @@
 #include "buffer.h"
 #include "cache.h"
+#include "dedup.h"
+#include "compress.h"
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
 
 cache *cash = nullptr;
 
@@ -76,17 +85,396 @@ get(const char *k, const char *expect)
     return;
   }
   
-  const_rope data = r->read();
+  const_rope data;
+  bool ok = r->read(&data);
+  assert(ok);
+  (void)ok;
   size_t n = strlen(expect);
-  for (const mem *m = data.pop(); m; m = data.pop()) {
-    assert(m->size <= n);
-    assert(memcmp(m->data, expect, m->size) == 0);
-    n -= m->size;
-    expect += m->size;
+  while (!data.empty()) {
+    buf b = data.pop();
+    assert(b.size() <= n);
+    assert(memcmp(b.headp(), expect, b.size()) == 0);
+    n -= b.size();
+    expect += b.size();
   }
   assert(n == 0);
 }
 
+static uint64_t
+gets(const char *k)
+{
+  buffer key = cbuffer(k);
+  cache::ref r = cash->get(key);
+  assert(r != nullptr);
+  return r->get_version();
+}
+
+static void
+cas(const char *k, const char *v, uint64_t unique, cache_error_t expect)
+{
+  cache_error_t err = cash->cas(cbuffer(k), 0, 0, unique, alloc(v));
+  assert(err == expect);
+}
+
+static void
+test3()
+{
+  // Check and set
+  reset();
+  set("eeyore", "gloomy");
+  uint64_t v1 = gets("eeyore");
+  assert(gets("eeyore") == v1);
+  cas("eeyore", "glum", v1, cache_error_t::stored);
+  get("eeyore", "glum");
+  cas("eeyore", "happy", v1, cache_error_t::cas_exists);
+  get("eeyore", "glum");
+  uint64_t v2 = gets("eeyore");
+  assert(v2 != v1);
+  cash->append(cbuffer("eeyore"), alloc("!"));
+  assert(gets("eeyore") != v2);
+  cas("eeyore", "happy", v2, cache_error_t::cas_exists);
+  set("eeyore", "gloomy");
+  assert(gets("eeyore") != v1);
+  cas("kanga", "roo", v1, cache_error_t::notfound);
+  std::cout << "test3 passed" << std::endl;
+}
+
+static void
+test4()
+{
+  // Fragmented values are coalesced
+  reset();
+  set("owl", "w");
+  std::string expect = "w";
+  for (int i = 0; i < 300; ++i) {
+    cash->append(cbuffer("owl"), alloc("o"));
+    expect += "o";
+  }
+  assert(cash->get(cbuffer("owl"))->get_segments() <= 129);
+  assert(cash->coalesce_count() > 0);
+  get("owl", expect.c_str());
+  cash->prepend(cbuffer("owl"), alloc("h"));
+  expect = "h" + expect;
+  get("owl", expect.c_str());
+  cash->collect();
+  assert(cash->get(cbuffer("owl"))->get_segments() == 1);
+  get("owl", expect.c_str());
+  std::cout << "test4 passed" << std::endl;
+}
+
+static void
+test5()
+{
+  // Memory accounting
+  reset();
+  assert(cash->item_bytes() == 0);
+  set("roo", "12345");
+  assert(cash->bytes() == 5);
+  assert(cash->key_bytes() >= sizeof(cache_key) + 3);
+  assert(cash->overhead_bytes() >= sizeof(entry)); // value is inline
+  size_t overhead = cash->overhead_bytes();
+  cash->append(cbuffer("roo"), alloc("6"));
+  assert(cash->bytes() == 6);
+  assert(cash->overhead_bytes() > overhead);
+  incr("roo", 1, 123457);
+  assert(cash->bytes() == 6);
+  set("roo", "1");
+  assert(cash->bytes() == 1);
+  set("roo", "kanga");
+  uint64_t a;
+  assert(cash->incr(cbuffer("roo"), 1, &a) == cache_error_t::not_numeric);
+  get("roo", "kanga");
+  cash->del(cbuffer("roo"));
+  assert(cash->bytes() == 0);
+  assert(cash->overhead_bytes() == 0);
+  assert(cash->table_bytes() > 0);
+  cash->collect();
+  assert(cash->item_bytes() == 0);
+  std::cout << "test5 passed" << std::endl;
+}
+
+static void
+test7()
+{
+  // A small item shares one chunk, which outlives the entry while the
+  // key is still in use.
+  reset();
+  set("kanga", "mother");
+  buf k = cbuffer("kanga");
+  assert(cash->item_bytes() < slab_good_size(sizeof(entry)) +
+         slab_good_size(cache_key::alloc_size(k)) +
+         slab_good_size(sizeof(mem) + 6));
+  set("kanga", "roo's mother");
+  cash->append(k, alloc("!"));
+  get("kanga", "roo's mother!");
+  cash->collect();
+  get("kanga", "roo's mother!");
+  cash->del(k);
+  cash->collect();
+  assert(cash->item_bytes() == 0);
+  std::cout << "test7 passed" << std::endl;
+}
+
+static void
+test8()
+{
+  // Deleting everything leaves whole pages free, whose memory goes
+  // back to the system.
+  delete cash;
+  cash = new cache(64 * 1024 * 1024);
+  std::string value(1000, 'x');
+  char k[16];
+  for (int i = 0; i < 5000; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    set(k, value.c_str());
+  }
+  for (int i = 0; i < 5000; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    cash->del(cbuffer(k));
+  }
+  cash->collect();
+  size_t before = slab_returned_bytes();
+  assert(slab_release_free() > 0);
+  assert(slab_release_free() == 0);
+  assert(slab_returned_bytes() > before);
+  set("k1", value.c_str());
+  get("k1", value.c_str());
+  std::cout << "test8 passed" << std::endl;
+}
+
+static void
+test9()
+{
+  // Equal large values are stored once, and copied before an append.
+  delete cash;
+  cash = new cache(64 * 1024 * 1024);
+  dedup_enable(dedup_default_min);
+  std::string value(4000, 'x');
+  char k[16];
+  for (int i = 0; i < 100; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    set(k, value.c_str());
+  }
+  dedup_stats st = dedup_get_stats();
+  assert(st.values == 1 && st.refs == 100);
+  assert(cash->item_bytes() < 10 * value.size());
+  cash->append(cbuffer("k1"), alloc("y"));
+  get("k1", (value + "y").c_str());
+  get("k2", value.c_str());
+  cash->collect();
+  assert(dedup_get_stats().refs == 99);
+  for (int i = 0; i < 100; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    cash->del(cbuffer(k));
+  }
+  cash->collect();
+  assert(dedup_get_stats().values == 0);
+  dedup_enable(0);
+  std::cout << "test9 passed" << std::endl;
+}
+
+static void
+test10()
+{
+  // Codec round trips, then compressed values through the cache.
+  std::string in;
+  for (int i = 0; i < 20000; ++i)
+    in += (i % 7 == 0) ? (char)(rand() & 0xff) : "abcabcd"[i % 7];
+  for (size_t n : { (size_t)0, (size_t)3, (size_t)17, in.size() }) {
+    std::vector<char> c(compress_bound(n)), d(n);
+    size_t cn = compress_bytes(in.data(), n, c.data());
+    assert(decompress_bytes(c.data(), cn, d.data(), n));
+    assert(std::string(d.data(), n) == in.substr(0, n));
+  }
+
+  delete cash;
+  cash = new cache(64 * 1024 * 1024);
+  compress_enable(256);
+  std::string value(5000, 'x');
+  set("a", value.c_str());
+  set("b", value.c_str());
+  compress_stats st = compress_get_stats();
+  assert(st.values == 2 && st.stored_bytes < st.raw_bytes / 10);
+  assert(cash->item_bytes() < value.size());
+  get("a", value.c_str());
+  // Corrupt data fails to decompress rather than asserting.
+  mem *raw = alloc(value.c_str()).head();
+  mem *packed = compress_value(raw, raw);
+  packed->data[0] ^= 1;          // the uncompressed size
+  assert(decompress_value(packed) == nullptr);
+  assert(compress_get_stats().failed == 1);
+  packed->data[0] ^= 1;
+  // Nor is a size more than the data could decode to allocated.
+  char size[4];
+  memcpy(size, packed->data, sizeof(size));
+  memset(packed->data, 0xff, sizeof(size));
+  assert(decompress_value(packed) == nullptr);
+  assert(compress_get_stats().failed == 2);
+  memcpy(packed->data, size, sizeof(size));
+  mem_free(packed);
+  mem_free(raw);
+  cash->append(cbuffer("a"), alloc("y"));
+  cash->prepend(cbuffer("b"), alloc("z"));
+  get("a", (value + "y").c_str());
+  get("b", ("z" + value).c_str());
+  cash->del(cbuffer("a"));
+  cash->del(cbuffer("b"));
+  cash->collect();
+  assert(compress_get_stats().values == 0);
+  compress_enable(0);
+  std::cout << "test10 passed" << std::endl;
+}
+
+static void
+test11()
+{
+  // A parked thread doesn't hold up collection, and keeps what it
+  // freed until going over the limit on pending garbage, which also
+  // forces checkpoints.
+  delete cash;
+  cash = new cache(64 * 1024 * 1024);
+  std::mutex lock;
+  std::condition_variable cv;
+  bool parked = false, done = false;
+  std::string value(1000, 'x');
+  std::thread t([&]() {
+      cpu_init();
+      set("parked", value.c_str());
+      cash->del(cbuffer("parked"));
+      gc_park();
+      std::unique_lock<std::mutex> l(lock);
+      parked = true;
+      cv.notify_all();
+      cv.wait(l, [&]() { return done; });
+      gc_unpark();
+      gc_exit();
+    });
+  {
+    std::unique_lock<std::mutex> l(lock);
+    cv.wait(l, [&]() { return parked; });
+  }
+  assert(gc_pending_objects() > 0);
+  char k[16];
+  for (int i = 0; i < 1000; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    set(k, value.c_str());
+    cash->del(cbuffer(k));
+  }
+  gc_set_limit(1);
+  assert(gc_over_limit());
+  uint64_t forced = gc_forced_checkpoints();
+  gc_relieve();
+  assert(gc_forced_checkpoints() == forced + 1);
+  gc_set_limit(0);
+  assert(!gc_over_limit());
+  gc_flush();
+  assert(gc_pending_objects() == 0);
+  assert(gc_oldest_pending_ms() == 0);
+  // With nobody online, flushes call back straight away, so a staged
+  // collect runs through.
+  int steps = 1;
+  bool flushed;
+  while (cash->collect_step()) {
+    flushed = false;
+    gc_flush_async([&]() { flushed = true; });
+    assert(flushed);
+    steps++;
+  }
+  assert(steps == 3);
+  // Deleting can be left to the reclaimer thread.
+  gc_start_reclaimer();
+  uint64_t destroyed = gc_destroyed_objects();
+  for (int i = 0; i < 100; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    set(k, value.c_str());
+    cash->del(cbuffer(k));
+  }
+  gc_finish();
+  assert(gc_destroyed_objects() > destroyed);
+  assert(gc_reclaim_queue_objects() == 0 && gc_pending_objects() == 0);
+  {
+    std::lock_guard<std::mutex> l(lock);
+    done = true;
+    cv.notify_all();
+  }
+  t.join();
+  std::cout << "test11 passed" << std::endl;
+}
+
+static void
+test12()
+{
+  // A pinned value outlives its item until unpinned.
+  std::string value(4000, 'x');
+  set("pinned", value.c_str());
+  const_rope r;
+  cash->get(cbuffer("pinned"))->read(&r);
+  const mem *m = r.head();
+  mem_pin(m);
+  assert(mem_pinned_count() == 1);
+  size_t deferred = mem_deferred_frees();
+  set("pinned", "gone");
+  gc_finish();
+  assert(mem_deferred_frees() == deferred + 1);
+  assert(r.size() == value.size() && memcmp(m->data, value.data(), 4000) == 0);
+  mem_unpin(m);
+  assert(mem_pinned_count() == 0);
+
+  // A shared value freed by both its items while pinned goes once
+  // both frees are replayed.
+  dedup_enable(1024);
+  set("twin1", value.c_str());
+  set("twin2", value.c_str());
+  cash->get(cbuffer("twin1"))->read(&r);
+  m = r.head();
+  assert(mem_shared(m) && dedup_get_stats().values == 1);
+  mem_pin(m);
+  deferred = mem_deferred_frees();
+  set("twin1", "gone");
+  set("twin2", "gone");
+  gc_finish();
+  assert(mem_deferred_frees() == deferred + 2);
+  assert(dedup_get_stats().values == 1);
+  mem_unpin(m);
+  assert(dedup_get_stats().values == 0);
+  dedup_enable(0);
+  std::cout << "test12 passed" << std::endl;
+}
+
+static void
+test6()
+{
+  // Log structured storage: overwriting most values leaves the old
+  // segments sparse, and collect moves the survivors out of them.
+  delete cash;
+  cash = new cache(64 * 1024 * 1024);
+  segment_enable();
+  std::string value(1000, 'x');
+  char k[16];
+  for (int i = 0; i < 3000; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    set(k, value.c_str());
+  }
+  for (int i = 0; i < 3000; ++i) {
+    if (i % 10 == 0)
+      continue;
+    snprintf(k, sizeof(k), "k%d", i);
+    set(k, "y");
+  }
+  // The reclaimer test11 started may still hold the old values.
+  gc_finish();
+  cash->collect();
+  cash->collect();
+  assert(cash->relocation_count() > 0);
+  assert(cash->log_eviction_count() == 0);
+  assert(segment_get_stats().released > 0);
+  for (int i = 0; i < 3000; ++i) {
+    snprintf(k, sizeof(k), "k%d", i);
+    get(k, i % 10 == 0 ? value.c_str() : "y");
+  }
+  std::cout << "test6 passed" << std::endl;
+}
+
 static void
 test2()
 {
@@ -120,9 +508,83 @@ test1()
   std::cout << "test1 passed" << std::endl;
 }
 
+static void
+test13()
+{
+  // A cas racing with appends either sees each of them or fails, so
+  // no append is lost.
+  delete cash;
+  cash = new cache(64 * 1024 * 1024);
+  set("tail", "a");
+  const int n = 20000;
+  std::atomic<bool> done(false);
+  std::thread t([&]() {
+      cpu_init();
+      for (int i = 0; i < n; ++i) {
+        cache_error_t err = cash->append(cbuffer("tail"), alloc("b"));
+        assert(err == cache_error_t::stored);
+        (void)err;
+      }
+      done = true;
+      gc_exit();
+    });
+  while (!done) {
+    cache::ref r = cash->get(cbuffer("tail"));
+    uint64_t version = r->get_version();
+    const_rope data;
+    r->read(&data);
+    std::string value;
+    while (!data.empty()) {
+      buf b = data.pop();
+      value.append(b.headp(), b.size());
+    }
+    cash->cas(cbuffer("tail"), 0, 0, version, alloc(value.c_str()));
+  }
+  t.join();
+  get("tail", ("a" + std::string(n, 'b')).c_str());
+  std::cout << "test13 passed" << std::endl;
+}
+
+static void
+test14()
+{
+  // With log storage, values too large for a segment are still
+  // evicted by atime, so they can't grow past the limit.
+  delete cash;
+  cash = new cache(16 * 1024 * 1024);
+  assert(segment_enabled());
+  char k[16];
+  for (int i = 0; i < 20; ++i) {
+    if (i == 10)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    snprintf(k, sizeof(k), "big%d", i);
+    set(k, std::string(1536 * 1024, 'a' + i).c_str());
+  }
+  assert(cash->item_bytes() > cash->max_item_bytes());
+  cash->collect();
+  assert(cash->item_bytes() <= cash->max_item_bytes());
+  for (int i = 0; i < 20; ++i) {
+    snprintf(k, sizeof(k), "big%d", i);
+    assert((cash->get(cbuffer(k)) == nullptr) == (i < 10));
+  }
+  std::cout << "test14 passed" << std::endl;
+}
+
 int main(int argc, char** argv)
 {
   test1();
   test2();
+  test3();
+  test4();
+  test5();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test6();                      // leaves segments enabled
+  test14();
   delete cash;
 }
@@ -0,0 +1,30 @@
+#include <cstdint>
+#include <cassert>
+
+// A flagged pointer to a slab chunk in 32 bits, so that two of them
+// fit in a word. See slab_ref.
+template<class T>
+class compact_ptr
+{
+private:
+  slab_ref data;
+
+  static constexpr slab_ref flag_mask = 1;
+public:
+
+  compact_ptr() noexcept : data(0) { }
+  compact_ptr(std::nullptr_t _) : data(0) { }
+  compact_ptr(T *ptr) noexcept : data(slab_compress(ptr)) { }
+  compact_ptr(T *ptr, int flags) noexcept
+  : data(slab_compress(ptr) | (slab_ref)flags) {
+    assert(flags == (flags & flag_mask));
+  }
+
+  int get_flags() const { return data & flag_mask; }
+  bool get_flag(int flag) const { return data & flag; }
+  T* get_ptr() const { return (T*)slab_expand(data & ~flag_mask); }
+  T& operator *() const { return *get_ptr(); }
+
+  bool operator==(const compact_ptr<T>& a) const { return data == a.data; }
+  bool operator!=(const compact_ptr<T>& a) const { return data != a.data; }
+};
@@ -0,0 +1,289 @@
+#include "slab.h"
+#include "mem.h"
+#include "compress.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include "counter.h"
+
+namespace {
+
+// Token: high nibble literal length, low nibble match length less
+// min_match. A nibble of 15 continues in following bytes, each added
+// until one is less than 255. Literals follow the token, then a two
+// byte little endian offset and the match. The last sequence has
+// only literals.
+constexpr size_t min_match = 4;
+constexpr size_t max_offset = 65535;
+constexpr int hash_bits = 12;
+// Values must shrink by at least this fraction to be kept compressed.
+constexpr double min_saving = 0.125;
+constexpr size_t header_size = sizeof(uint32_t);
+// The most a byte of compressed data decodes to: a length byte of 255
+// in a match.
+constexpr size_t max_expansion = 255;
+// Scratch buffers grown past this are given back after use.
+constexpr size_t scratch_keep = 256 * 1024;
+
+std::atomic<size_t> min_size(0);
+
+counter nvalues;
+counter nraw;
+counter nstored;
+counter ncompressed;
+counter nrejected;
+counter ndecompressed;
+counter nfailed;
+counter compress_nsec;
+counter decompress_nsec;
+
+uint32_t
+read32(const char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+uint32_t
+hash4(const char *p)
+{
+  return (read32(p) * 2654435761U) >> (32 - hash_bits);
+}
+
+char *
+put_length(char *out, size_t n)
+{
+  for (; n >= 255; n -= 255)
+    *out++ = (char)255;
+  *out++ = (char)n;
+  return out;
+}
+
+// Read a length continued past its nibble. Returns false if the input
+// ends first.
+bool
+get_length(const unsigned char *&in, const unsigned char *end, size_t *n)
+{
+  unsigned char b;
+  do {
+    if (in == end)
+      return false;
+    b = *in++;
+    *n += b;
+  } while (b == 255);
+  return true;
+}
+
+char *
+put_sequence(char *out, const char *lit, size_t nlit,
+             size_t offset, size_t match)
+{
+  char *token = out++;
+  *token = (char)(std::min(nlit, (size_t)15) << 4);
+  if (nlit >= 15)
+    out = put_length(out, nlit - 15);
+  memcpy(out, lit, nlit);
+  out += nlit;
+  if (match == 0)
+    return out;
+  *out++ = (char)(offset & 0xff);
+  *out++ = (char)(offset >> 8);
+  size_t m = match - min_match;
+  *token |= (char)std::min(m, (size_t)15);
+  if (m >= 15)
+    out = put_length(out, m - 15);
+  return out;
+}
+
+uint64_t
+now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+}
+
+size_t
+compress_bound(size_t n)
+{
+  return n + n / 255 + 16;
+}
+
+size_t
+compress_bytes(const char *in, size_t n, char *out)
+{
+  uint32_t table[1 << hash_bits];
+  memset(table, 0, sizeof(table));
+  char *o = out;
+  size_t lit = 0;               // start of pending literals
+  size_t i = 0;
+  // Leave room to read 4 bytes at any candidate position.
+  while (n >= min_match && i <= n - min_match) {
+    uint32_t h = hash4(in + i);
+    size_t cand = table[h];
+    table[h] = i;
+    if (cand >= i || i - cand > max_offset ||
+        read32(in + cand) != read32(in + i)) {
+      i++;
+      continue;
+    }
+    size_t len = min_match;
+    while (i + len < n && in[cand + len] == in[i + len])
+      len++;
+    o = put_sequence(o, in + lit, i - lit, i - cand, len);
+    i += len;
+    lit = i;
+  }
+  return put_sequence(o, in + lit, n - lit, 0, 0) - out;
+}
+
+bool
+decompress_bytes(const char *in, size_t n, char *out, size_t raw)
+{
+  const unsigned char *p = (const unsigned char *)in, *end = p + n;
+  char *o = out, *oend = out + raw;
+  while (p < end) {
+    unsigned token = *p++;
+    size_t nlit = token >> 4;
+    if (nlit == 15 && !get_length(p, end, &nlit))
+      return false;
+    if (nlit > (size_t)(end - p) || nlit > (size_t)(oend - o))
+      return false;
+    memcpy(o, p, nlit);
+    o += nlit;
+    p += nlit;
+    if (p == end)
+      break;
+    if (end - p < 2)
+      return false;
+    size_t offset = p[0] | (p[1] << 8);
+    p += 2;
+    size_t match = token & 15;
+    if (match == 15 && !get_length(p, end, &match))
+      return false;
+    match += min_match;
+    if (offset == 0 || offset > (size_t)(o - out) ||
+        match > (size_t)(oend - o))
+      return false;
+    // May overlap, so copy forwards a byte at a time.
+    const char *from = o - offset;
+    for (size_t j = 0; j < match; ++j)
+      *o++ = from[j];
+  }
+  return o == oend;
+}
+
+void
+compress_enable(size_t min)
+{
+  min_size = min;
+}
+
+bool
+compress_enabled()
+{
+  return min_size.load(std::memory_order_relaxed) != 0;
+}
+
+mem *
+compress_value(const mem *head, const mem *tail)
+{
+  size_t n = mem_size(head, tail);
+  if (n < min_size || mem_compressed(head) || n > UINT32_MAX)
+    return nullptr;
+
+  uint64_t start = now_nsec();
+  thread_local std::vector<char> flat, out;
+  // Don't keep the largest value each thread ever saw.
+  struct trim {
+    ~trim() {
+      for (std::vector<char> *v : { &flat, &out })
+        if (v->capacity() > scratch_keep)
+          std::vector<char>().swap(*v);
+    }
+  } trim_scratch;
+  const char *in = head->data;
+  if (head != tail) {
+    flat.resize(n);
+    char *p = flat.data();
+    for (const mem *m = head; ; m = m->next) {
+      memcpy(p, m->data, m->size);
+      p += m->size;
+      if (m == tail)
+        break;
+    }
+    in = flat.data();
+  }
+  out.resize(compress_bound(n));
+  size_t c = compress_bytes(in, n, out.data());
+  if (c + header_size > n * (1.0 - min_saving)) {
+    nrejected.incr();
+    compress_nsec.add(now_nsec() - start);
+    return nullptr;
+  }
+
+  mem *m = mem_alloc(header_size + c);
+  uint32_t raw = n;
+  memcpy(m->data, &raw, header_size);
+  memcpy(m->data + header_size, out.data(), c);
+  m->flags |= mem_flag_compressed;
+  compress_account(m, 1);
+  ncompressed.incr();
+  compress_nsec.add(now_nsec() - start);
+  return m;
+}
+
+mem *
+decompress_value(const mem *m)
+{
+  assert(mem_compressed(m));
+  uint64_t start = now_nsec();
+  // Don't allocate what a corrupt header claims.
+  if (m->size < header_size ||
+      compress_raw_size(m) > (m->size - header_size) * max_expansion) {
+    nfailed.incr();
+    return nullptr;
+  }
+  size_t raw = compress_raw_size(m);
+  mem *d = mem_alloc(raw);
+  if (!decompress_bytes(m->data + header_size, m->size - header_size,
+                        d->data, raw)) {
+    mem_free(d);
+    nfailed.incr();
+    return nullptr;
+  }
+  ndecompressed.incr();
+  decompress_nsec.add(now_nsec() - start);
+  return d;
+}
+
+size_t
+compress_raw_size(const mem *m)
+{
+  return read32(m->data);
+}
+
+void
+compress_account(const mem *m, int n)
+{
+  nvalues.add(n);
+  nraw.add(n * (ssize_t)compress_raw_size(m));
+  nstored.add(n * (ssize_t)m->size);
+}
+
+compress_stats
+compress_get_stats()
+{
+  return { (size_t)nvalues, (size_t)nraw, (size_t)nstored,
+           (size_t)ncompressed, (size_t)nrejected, (size_t)ndecompressed,
+           (size_t)nfailed,
+           (size_t)compress_nsec / 1000, (size_t)decompress_nsec / 1000 };
+}
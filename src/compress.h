@@ -0,0 +1,54 @@
+/* -*-c++-*- */
+/* Value compression.
+ *
+ * When enabled, values of at least a minimum size are compressed as
+ * they are stored, and when append coalesces a value. A compressed
+ * value is a single mem flagged mem_flag_compressed, holding the
+ * uncompressed size followed by the compressed bytes. entry::read()
+ * hands out a decompressed copy; append, prepend and incr decompress
+ * the value in place first. A value which fails to decompress is
+ * dropped.
+ *
+ * The codec is a small byte oriented LZ77, in the spirit of LZ4:
+ * fast, and no external dependency.
+ */
+#include <cstddef>
+#include <cstdint>
+
+constexpr size_t compress_default_min = 4096;
+
+// Compress values of at least min_size bytes; 0 turns it off.
+void compress_enable(size_t min_size);
+bool compress_enabled();
+
+// Return a compressed copy of head through tail, or nullptr if the
+// value is too small or doesn't compress well. The chain is left
+// alone.
+mem *compress_value(const mem *head, const mem *tail);
+// Return an uncompressed copy of a compressed mem, or nullptr if it
+// is corrupt.
+mem *decompress_value(const mem *m);
+// Size of a compressed mem's value, uncompressed.
+size_t compress_raw_size(const mem *m);
+// Count a compressed mem as it is copied (n = 1) or freed (n = -1).
+void compress_account(const mem *m, int n);
+
+// Raw codec. compress_bound() is the most compress_bytes() can write.
+// decompress_bytes() returns false on malformed input.
+size_t compress_bound(size_t n);
+size_t compress_bytes(const char *in, size_t n, char *out);
+bool decompress_bytes(const char *in, size_t n, char *out, size_t raw);
+
+struct compress_stats
+{
+  size_t values;                // compressed values, live
+  size_t raw_bytes;             // their size uncompressed
+  size_t stored_bytes;          // and compressed
+  size_t compressed;            // values compressed since startup
+  size_t rejected;              // values which didn't compress
+  size_t decompressed;
+  size_t failed;                // values which failed to decompress
+  size_t compress_usec;         // time spent compressing
+  size_t decompress_usec;
+};
+compress_stats compress_get_stats();
@@ -1,11 +1,14 @@
 #include <cstddef>
 #include <cstdint>
+#include "buffer.h"
 #include "mem.h"
 #include "const_rope.h"
 #include "murmur2.h"
 
 size_t const_rope::size() const
 {
+  if (head_ == nullptr)
+    return inline_.size();
   size_t s = head_->size;
   for (const mem *m = head_; m != tail_; m = m->next)
     s += m->next->size;
@@ -14,6 +17,9 @@ size_t const_rope::size() const
 
 uint64_t const_rope::hash(uint64_t seed) const
 {
+  if (head_ == nullptr)
+    return MurmurHash64A(inline_.headp(), inline_.size(), seed);
+
   // XXX - MurmurHash64B is optimized for 32-bit systems
   // XXX - We really want to use an incremental hash
   uint64_t hash = MurmurHash64A(head_->data, head_->size, seed);
@@ -23,8 +29,14 @@ uint64_t const_rope::hash(uint64_t seed) const
   return hash;
 }
 
-const mem *const_rope::pop()
+buf const_rope::pop()
 {
+  assert(!empty());
+  if (head_ == nullptr) {
+    buf r = inline_;
+    inline_ = buf();
+    return r;
+  }
   const mem *r = head_;
   if (r == tail_) {
     head_ = nullptr;
@@ -32,5 +44,5 @@ const mem *const_rope::pop()
   } else {
     head_ = head_->next;
   }
-  return r;
+  return buf(r->data, r->size);
 }
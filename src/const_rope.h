@@ -4,7 +4,8 @@
  * buffers which represent the value of the object. Be consist in
  * reads (for GETS, etc) we remember not only the head of the linked
  * list but also the tail.  Const rope is basically this head/tail
- * pair.
+ * pair. Small values stored inline in their entry have no mem, so
+ * the rope is then just the bytes.
  */
 struct mem;
 
@@ -15,13 +16,18 @@ class const_rope
 private:
   const mem *head_;
   const mem *tail_;
+  buf inline_;
 public:
   const_rope() : const_rope(nullptr, nullptr) { }
   const_rope(const mem *head, const mem *tail)
     : head_(head), tail_(tail) { }
+  explicit const_rope(buf b) : head_(nullptr), tail_(nullptr), inline_(b) { }
 
   size_t size() const;
   uint64_t hash(uint64_t seed) const;
-  const mem *pop();
+  bool empty() const { return head_ == nullptr && inline_.headp() == nullptr; }
+  // First mem not yet popped, nullptr if inline.
   const mem *head() const { return head_; }
+  // Next piece of the value. The rope must not be empty.
+  buf pop();
 };
@@ -1,13 +1,10 @@
 #include <cstdint>
 
-#define MAX_CPUS (32)
-
-typedef uint64_t cpu_mask_t;
-cpu_mask_t cpu_mask_all();
-
+// Threads which read garbage collected objects call cpu_init() when
+// they start and cpu_exit() when done, which brings them online with
+// the collector (see gc.h). Ids are handed out in order.
 void cpu_init();
 
 int cpu_id();
 int cpu_count();
 void cpu_exit();
-bool cpu_seen_all(cpu_mask_t seen);
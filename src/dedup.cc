@@ -0,0 +1,200 @@
+#include "slab.h"
+#include "mem.h"
+#include "dedup.h"
+#include "compress.h"
+#include "murmur2.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "counter.h"
+
+namespace {
+
+constexpr int nstripes = 64;
+
+// Precedes the shared mem, as the first of two objects in a shared
+// chunk, so both are freed along with the chunk.
+struct dedup_header
+{
+  std::atomic<uint32_t> refs;
+  uint32_t unused;
+  uint64_t hash;
+};
+static_assert(sizeof(dedup_header) == 16, "dedup header");
+
+struct stripe
+{
+  std::mutex lock;
+  std::unordered_multimap<uint64_t, dedup_header *> values;
+};
+
+std::atomic<size_t> min_size(0);
+stripe stripes[nstripes];
+
+counter nvalues;
+counter nrefs;
+counter nbytes;
+counter nlogical;
+counter nfootprint;
+
+dedup_header *
+header_of(const mem *m)
+{
+  return (dedup_header *)((char *)m - sizeof(dedup_header));
+}
+
+mem *
+value_of(dedup_header *h)
+{
+  return (mem *)(h + 1);
+}
+
+uint64_t
+hash_value(const mem *head, const mem *tail)
+{
+  uint64_t h = 0;
+  for (const mem *m = head; ; m = m->next) {
+    h = MurmurHash64A(m->data, m->size, h);
+    if (m == tail)
+      return h;
+  }
+}
+
+bool
+equal_value(const mem *shared, const mem *head, const mem *tail)
+{
+  const char *p = shared->data;
+  for (const mem *m = head; ; m = m->next) {
+    if (memcmp(p, m->data, m->size) != 0)
+      return false;
+    p += m->size;
+    if (m == tail)
+      return true;
+  }
+}
+
+// Take a reference unless the value is already being freed.
+bool
+ref(dedup_header *h)
+{
+  uint32_t r = h->refs;
+  while (r != 0)
+    if (h->refs.compare_exchange_weak(r, r + 1))
+      return true;
+  return false;
+}
+
+}
+
+void
+dedup_enable(size_t min)
+{
+  min_size = min;
+}
+
+bool
+dedup_enabled()
+{
+  return min_size.load(std::memory_order_relaxed) != 0;
+}
+
+mem *
+dedup_value(mem *head, mem *tail)
+{
+  if (mem_shared(head))
+    return nullptr;
+  size_t size = mem_size(head, tail);
+  size_t sizes[2] = { sizeof(dedup_header), sizeof(mem) + size };
+  if (size < min_size || slab_shared_size(sizes, 2) > slab_page_data_size)
+    return nullptr;
+
+  // A compressed value only matches another compressed one.
+  bool compressed = head == tail && mem_compressed(head);
+  uint64_t hash = hash_value(head, tail);
+  stripe &s = stripes[hash % nstripes];
+  std::unique_lock<std::mutex> l(s.lock);
+  auto range = s.values.equal_range(hash);
+  for (auto i = range.first; i != range.second; ++i) {
+    mem *m = value_of(i->second);
+    if ((size_t)m->size == size && mem_compressed(m) == compressed &&
+        equal_value(m, head, tail) &&
+        ref(i->second)) {
+      l.unlock();
+      nrefs.incr();
+      nlogical.add(size);
+      mem_free(head);
+      return m;
+    }
+  }
+
+  void *objs[2];
+  slab_alloc_shared(sizes, 2, objs);
+  dedup_header *h = static_cast<dedup_header *>(objs[0]);
+  assert(objs[1] == value_of(h));
+  h->refs = 1;
+  h->hash = hash;
+  mem *m = mem_init(objs[1], size);
+  char *out = m->data;
+  for (const mem *p = head; ; p = p->next) {
+    memcpy(out, p->data, p->size);
+    out += p->size;
+    if (p == tail)
+      break;
+  }
+  m->flags = mem_flag_shared;
+  if (compressed) {
+    m->flags |= mem_flag_compressed;
+    compress_account(m, 1);
+  }
+  s.values.emplace(hash, h);
+  l.unlock();
+
+  nvalues.incr();
+  nrefs.incr();
+  nbytes.add(size);
+  nlogical.add(size);
+  nfootprint.add(slab_usable_size(h) + slab_usable_size(m));
+  mem_free(head);
+  return m;
+}
+
+void
+dedup_release(mem *m)
+{
+  assert(mem_shared(m));
+  dedup_header *h = header_of(m);
+  nrefs.decr();
+  nlogical.sub(m->size);
+  if (h->refs.fetch_sub(1) != 1)
+    return;
+
+  stripe &s = stripes[h->hash % nstripes];
+  {
+    std::lock_guard<std::mutex> l(s.lock);
+    auto range = s.values.equal_range(h->hash);
+    for (auto i = range.first; i != range.second; ++i) {
+      if (i->second == h) {
+        s.values.erase(i);
+        break;
+      }
+    }
+  }
+  nvalues.decr();
+  nbytes.sub(m->size);
+  nfootprint.sub(slab_usable_size(h) + slab_usable_size(m));
+  if (mem_compressed(m))
+    compress_account(m, -1);
+  slab_free(m);
+  slab_free(h);
+}
+
+dedup_stats
+dedup_get_stats()
+{
+  return { (size_t)nvalues, (size_t)nrefs, (size_t)nbytes,
+           (size_t)nlogical, (size_t)nfootprint };
+}
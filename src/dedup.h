@@ -0,0 +1,38 @@
+/* -*-c++-*- */
+/* Deduplication of large values.
+ *
+ * When enabled, values of at least a minimum size are hashed as they
+ * are stored, and items with equal values share one copy. A shared
+ * value is a single mem, marked by mem_flag_shared, with a reference
+ * count in front of it; mem_free() drops a reference, and the copy is
+ * freed with the last. Shared mems are never written to: append
+ * copies the value first, while prepend, incr and cas replace or
+ * link in front of it.
+ *
+ * A shared value is not counted by mem_footprint(), so items don't
+ * each pay for it; dedup_get_stats() reports the memory instead.
+ */
+#include <cstddef>
+
+constexpr size_t dedup_default_min = 1024;
+
+// Share values of at least min_size bytes; 0 turns sharing off.
+void dedup_enable(size_t min_size);
+bool dedup_enabled();
+
+// Return a shared mem with the same contents as head through tail,
+// and free the chain. Returns nullptr, leaving the chain alone, if
+// the value is too small or too large to share.
+mem *dedup_value(mem *head, mem *tail);
+// Drop a reference to a shared mem.
+void dedup_release(mem *m);
+
+struct dedup_stats
+{
+  size_t values;                // distinct shared values
+  size_t refs;                  // items referring to them
+  size_t bytes;                 // payload of the shared values
+  size_t logical_bytes;         // payload times references
+  size_t footprint;             // memory allocated for them
+};
+dedup_stats dedup_get_stats();
@@ -1,42 +1,224 @@
 #include <ctime>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
+#include <new>
 
+#include "buffer.h"
 #include "murmur2.h"
 #include "mem.h"
 #include "rope.h"
 #include "entry.h"
+#include "compress.h"
 
 namespace {
   thread_local int updated_atime = 0;
   constexpr int update_atime_every = 8;
+
+  // CAS uniques are handed out to threads in blocks, so the shared
+  // sequence is only touched once every cas_block_size writes.
+  constexpr uint64_t cas_block_size = 1024;
+  std::atomic<uint64_t> cas_sequence(1);
+  thread_local uint64_t cas_next = 0;
+  thread_local uint64_t cas_limit = 0;
+}
+
+uint64_t
+cas_unique_next()
+{
+  if (cas_next == cas_limit) {
+    cas_next = cas_sequence.fetch_add(cas_block_size);
+    cas_limit = cas_next + cas_block_size;
+  }
+  return cas_next++;
+}
+
+static bool
+cmpxchg128(__int128 *a, __int128 b, __int128 c)
+{
+  return __sync_bool_compare_and_swap(a, b, c);
+}
+
+entry::entry(uint32_t flags, uint32_t exptime, const mem *m)
+  : gc_object(gc_kind_of<entry>()), data(nullptr, nullptr),
+    version(cas_unique_next()), segments(0), flags(flags), exptime(exptime),
+    inline_size(m->size)
+#ifndef NDEBUG
+  , deleted(false)
+#endif
+{
+  memcpy(const_cast<char *>(inline_data()), m->data, m->size);
 }
 
 entry::~entry()
 {
+#ifndef NDEBUG
   assert(deleted == false);
   deleted = true;
-  mem_free(data.head);
+#endif
+  if (data.head)
+    mem_free(data.head);
 }
 
+entry *
+entry::place(void *p, uint32_t flags, uint32_t exptime, const rope &r)
+{
+  if (!inlines(r))
+    return ::new (p) entry(flags, exptime, r);
+  entry *e = ::new (p) entry(flags, exptime, r.head());
+  mem_free(r.head());
+  return e;
+}
+
+entry *
+entry::alloc(uint32_t flags, uint32_t exptime, const rope &r)
+{
+  return place(slab_alloc(alloc_size(r)), flags, exptime, r);
+}
+
+// Readers may still be looking at the inline bytes, but they stay put
+// until the entry is freed.
 void
-entry::append(const rope &a)
+entry::uninline(value_delta *delta)
 {
-  mem *old = data.tail.exchange(a.tail());
-  assert(old->next == nullptr);
-  old->next = a.head();
-  mtime.update();
+  if (data.head != nullptr)
+    return;
+  mem *m = mem_alloc(inline_size);
+  memcpy(m->data, inline_data(), inline_size);
+  struct { mem *head, *tail; } p = { nullptr, nullptr }, n = { m, m };
+  if (cmpxchg128((__int128*)&data, *(__int128*)&p, *(__int128*)&n)) {
+    segments = 1;
+    delta->footprint += mem_footprint(m, m);
+  } else {
+    mem_free(m);
+  }
 }
 
+// Swap a compressed value for its uncompressed copy. Readers of the
+// compressed mem have their own copies, so it can go to the collector.
+// A corrupt value is swapped for an empty one and the entry dropped.
 void
-entry::prepend(const rope &p)
+entry::decompress(value_delta *delta)
 {
-  mem *old = data.head;
-  do {
+  struct { mem *head, *tail; } p = { data.head, data.tail };
+  while (p.head != nullptr && mem_compressed(p.head)) {
+    mem *m = decompress_value(p.head);
+    bool corrupt = m == nullptr;
+    if (corrupt)
+      m = mem_alloc(0);
+    struct { mem *head, *tail; } n = { m, m };
+    p.tail = p.head;
+    if (cmpxchg128((__int128*)&data, *(__int128*)&p, *(__int128*)&n)) {
+      if (corrupt) {
+        delta->bytes -= compress_raw_size(p.head);
+        drop();
+      }
+      delta->footprint += (ssize_t)mem_footprint(m, m) -
+        mem_footprint(p.head, p.head);
+      mem_gc_free(p.head);
+      return;
+    }
+    mem_free(m);
+    p.head = data.head;
+  }
+}
+
+// Writers in place, cas() included, set version_writing while they
+// change data, so they take turns and a cas() can't overwrite a write
+// it didn't see. coalesce() and relocate() don't claim the version:
+// they keep the value as it is, and writers retry their swaps around
+// them. Returns the version before the write.
+uint64_t
+entry::claim_version()
+{
+  for (;;) {
     // XXX - backoff?
-    p.tail()->next = old;
-  } while (!data.head.compare_exchange_weak(old, p.head()));
+    uint64_t v = version;
+    if (!(v & version_writing) &&
+        version.compare_exchange_weak(v, v | version_writing))
+      return v;
+  }
+}
+
+// Finish a write with a new version, or the old one if nothing changed.
+void
+entry::release_version(uint64_t v)
+{
+  version = v;
+}
+
+// Expire the entry, so the next collection removes it.
+void
+entry::drop()
+{
+  exptime = 1;
+}
+
+// coalesce() and relocate() may compress the value again while we
+// work, so a segment is only linked in while the head is known not to
+// be compressed: append swaps tail and head together, prepend swaps a
+// head it checked.
+void
+entry::append(const rope &a, value_delta *delta)
+{
+  struct { mem *head, *tail; } p, n;
+  uint64_t prior = claim_version();
+  try {
+    uninline(delta);
+    for (;;) {
+      p.head = data.head;
+      p.tail = data.tail;
+      if (mem_compressed(p.head)) {
+        decompress(delta);
+      } else if (mem_shared(p.tail)) {
+        // Copy a shared value before linking anything after it.
+        rewrite(delta, true);
+      } else {
+        n.head = p.head;
+        n.tail = a.tail();
+        if (cmpxchg128((__int128*)&data, *(__int128*)&p, *(__int128*)&n))
+          break;
+      }
+    }
+  } catch (std::bad_alloc &) {
+    release_version(prior);
+    mem_free(a.head());
+    throw;
+  }
+  delta->bytes += a.size();
+  delta->footprint += mem_footprint(a.head(), a.tail());
+  assert(p.tail->next == nullptr);
+  p.tail->next = a.head();
+  segments += a.segments();
+  mtime.update();
+  release_version(cas_unique_next());
+}
+
+void
+entry::prepend(const rope &p, value_delta *delta)
+{
+  uint64_t prior = claim_version();
+  try {
+    uninline(delta);
+    mem *old = data.head;
+    do {
+      // XXX - backoff?
+      while (mem_compressed(old)) {
+        decompress(delta);
+        old = data.head;
+      }
+      p.tail()->next = old;
+    } while (!data.head.compare_exchange_weak(old, p.head()));
+  } catch (std::bad_alloc &) {
+    release_version(prior);
+    mem_free(p.head());
+    throw;
+  }
+  delta->bytes += p.size();
+  delta->footprint += mem_footprint(p.head(), p.tail());
+  segments += p.segments();
   mtime.update();
+  release_version(cas_unique_next());
 }
 
 static const mem *
@@ -63,76 +245,99 @@ mem_consume_whitespace(const mem *head, const mem *tail,
                                 tail, 0, i_out);
 }
 
-static uint64_t
-mem_atoi_r(const mem *head, const mem *tail, uint64_t a, mem::size_t i)
+// Returns false if the value isn't a number.
+static bool
+mem_atoi_r(const mem *head, const mem *tail, uint64_t *a, mem::size_t i)
 {
   for(; i < head->size; ++i) {
     switch (head->data[i]) {
     case '0' ... '9':
-      a = a * 10 + head->data[i] - '0';
+      *a = *a * 10 + head->data[i] - '0';
       continue;
     default:
       head = mem_consume_whitespace(head, tail, i, &i);
-      if (head != tail || i != tail->size)
-        throw "not a number";   // XXX
-      return a;
+      return head == tail && i == tail->size;
     }
   }
   if (head == tail)
-    return a;
+    return true;
 
   return mem_atoi_r(head->next, tail, a, 0);
 }
 
-static uint64_t
-mem_atoi(const mem *head, const mem *tail)
+static bool
+mem_atoi(const mem *head, const mem *tail, uint64_t *a)
 {
   mem::size_t i;
   head = mem_consume_whitespace(head, tail, 0, &i);
-  return mem_atoi_r(head, tail, 0, i);
-}
-
-static bool
-cmpxchg128(__int128 *a, __int128 b, __int128 c)
-{
-  return __sync_bool_compare_and_swap(a, b, c);
+  *a = 0;
+  return mem_atoi_r(head, tail, a, i);
 }
 
 enum { max_incr_size = 32 };      // XXX real max
-uint64_t
-entry::incrdecr(std::function<uint64_t (uint64_t )> doit)
+bool
+entry::incrdecr(std::function<uint64_t (uint64_t )> doit, value_delta *delta,
+                uint64_t *out)
 {
-  mem *b = mem_alloc(max_incr_size); // XXX - free b on exception
+  // XXX - parse inline values directly rather than moving them out
+  uninline(delta);
+  decompress(delta);
+  mem *b = mem_alloc(max_incr_size);
   struct { mem *head, *tail; } n = { b, b };
 
   uint64_t a;
   struct { mem *head, *tail; } p;
-  do {
-    // XXX - backoff?
-    p.head = data.head;
-    p.tail = data.tail;
-    a = mem_atoi(p.head, p.tail); // XXX - head and tail might be
-                                  // disconnected
-    a = doit(a);
-    b->size = snprintf(b->data, max_incr_size, "%lu", a);
-    assert(b->size < max_incr_size);
-  } while(!cmpxchg128((__int128*)&data, *(__int128*)&p, *(__int128*)&n));
-  mem_free(p.head);
-  
+  uint64_t prior = claim_version();
+  try {
+    for (;;) {
+      // XXX - backoff?
+      p.head = data.head;
+      p.tail = data.tail;
+      if (mem_compressed(p.head)) {
+        // Compressed again by relocate().
+        decompress(delta);
+        continue;
+      }
+      // XXX - head and tail might be disconnected
+      if (!mem_atoi(p.head, p.tail, &a)) {
+        release_version(prior);
+        mem_free(b);
+        return false;
+      }
+      a = doit(a);
+      b->size = snprintf(b->data, max_incr_size, "%lu", a);
+      assert(b->size < max_incr_size);
+      if (cmpxchg128((__int128*)&data, *(__int128*)&p, *(__int128*)&n))
+        break;
+    }
+  } catch (std::bad_alloc &) {
+    release_version(prior);
+    mem_free(b);
+    throw;
+  }
+  delta->bytes += (ssize_t)b->size - mem_size(p.head, p.tail);
+  delta->footprint += (ssize_t)mem_footprint(b, b) -
+    mem_footprint(p.head, p.tail);
+  // Readers and coalesce() may still be walking the old chain.
+  mem_gc_free(p.head);
+  segments = 1;
   mtime.update();
-  return a;
+  release_version(cas_unique_next());
+  *out = a;
+  return true;
 }
 
-uint64_t
-entry::incr(uint64_t v)
+bool
+entry::incr(uint64_t v, value_delta *delta, uint64_t *out)
 {
-  return incrdecr([&](uint64_t a) { return a + v; });
+  return incrdecr([&](uint64_t a) { return a + v; }, delta, out);
 }
 
-uint64_t
-entry::decr(uint64_t v)
+bool
+entry::decr(uint64_t v, value_delta *delta, uint64_t *out)
 {
-  return incrdecr([&](uint64_t a) { return (a > v) ? a - v : 0; });
+  return incrdecr([&](uint64_t a) { return (a > v) ? a - v : 0; }, delta,
+                  out);
 }
 
 bool
@@ -146,32 +351,143 @@ entry::expired() const
     return false;
 }
 
-const_rope
-entry::read()
+bool
+entry::read(const_rope *r)
 {
   mem *head = data.head;
   if (updated_atime++ % update_atime_every == 0)
     atime.update();
-  return const_rope(head, mem_tail(head));
+  if (head == nullptr) {
+    *r = const_rope(buf(inline_data(), inline_size));
+  } else if (mem_compressed(head)) {
+    mem *m = decompress_value(head);
+    if (m == nullptr) {
+      drop();
+      return false;
+    }
+    // The copy lives as long as the reader could.
+    mem_gc_free(m);
+    *r = const_rope(m, m);
+  } else {
+    *r = const_rope(head, mem_tail(head));
+  }
+  return true;
+}
+
+// Size of the value in head through tail, uncompressed.
+static size_t
+value_size(const mem *head, const mem *tail)
+{
+  if (mem_compressed(head))
+    return compress_raw_size(head);
+  return mem_size(head, tail);
 }
 
 bool
 entry::cas(uint32_t newflags, uint32_t newexptime,
-           uint64_t version, const rope &r)
+           uint64_t expected, const rope &r, value_delta *delta)
 {
-  const_rope cur = const_rope(data.head, data.tail);
-  uint64_t cur_version = cur.hash(flags);
-  assert(sizeof(cur) == sizeof(data));
+  // Claim the version only if it is the one expected, so only one of
+  // several racing cas operations with the same unique can succeed. A
+  // version being written is about to change, so it never matches.
+  uint64_t cur_version = version;
+  if (cur_version != expected || (expected & version_writing) ||
+      !version.compare_exchange_strong(cur_version,
+                                       cur_version | version_writing))
+    return false;
 
-  if (cur_version == version &&
-      cmpxchg128((__int128*)&data, *(__int128*)&cur, *(__int128*)&r)) {
-    flags = newflags;
-    exptime = newexptime;
-    mtime.update();
-    return true;
+  // Only coalesce() and relocate() can change data now, and they keep
+  // the value, so retry until the swap lands.
+  struct { mem *head, *tail; } p;
+  assert(sizeof(p) == sizeof(data));
+  do {
+    p.head = data.head;
+    p.tail = data.tail;
+  } while (!cmpxchg128((__int128*)&data, *(__int128*)&p, *(__int128*)&r));
+  flags = newflags;
+  exptime = newexptime;
+  segments = r.segments();
+  // An inline value has no mem to free, and no footprint apart from
+  // the entry's.
+  if (p.head == nullptr) {
+    delta->bytes = (ssize_t)r.size() - inline_size;
+    delta->footprint = mem_footprint(r.head(), r.tail());
   } else {
+    delta->bytes = (ssize_t)r.size() - value_size(p.head, p.tail);
+    delta->footprint = (ssize_t)mem_footprint(r.head(), r.tail()) -
+      mem_footprint(p.head, p.tail);
+    mem_gc_free(p.head);
+  }
+  mtime.update();
+  release_version(cas_unique_next());
+  return true;
+}
+
+bool
+entry::coalesce(value_delta *delta)
+{
+  return rewrite(delta, false);
+}
+
+bool
+entry::relocate(value_delta *delta)
+{
+  return rewrite(delta, true);
+}
+
+bool
+entry::rewrite(value_delta *delta, bool always)
+{
+  struct { mem *head, *tail; } p = { data.head, data.tail };
+  if (p.head == nullptr || (p.head == p.tail && !always))
     return false;
+
+  // head and tail were not read atomically, and an append may not
+  // have linked its segment yet. Either way we can't reach tail.
+  size_t size = 0;
+  for (const mem *m = p.head; m != p.tail; m = m->next) {
+    if (m == nullptr)
+      return false;
+    size += m->size;
   }
+  size += p.tail->size;
+
+  mem *b = mem_alloc(size);
+  char *out = b->data;
+  for (const mem *m = p.head; ; m = m->next) {
+    memcpy(out, m->data, m->size);
+    out += m->size;
+    if (m == p.tail)
+      break;
+  }
+  if (mem_compressed(p.head)) {
+    // Relocated as is.
+    b->flags |= mem_flag_compressed;
+    compress_account(b, 1);
+  } else if (compress_enabled()) {
+    mem *c;
+    try {
+      c = compress_value(b, b);
+    } catch (std::bad_alloc &) {
+      mem_free(b);
+      throw;
+    }
+    if (c) {
+      mem_free(b);
+      b = c;
+    }
+  }
+
+  struct { mem *head, *tail; } n = { b, b };
+  if (!cmpxchg128((__int128*)&data, *(__int128*)&p, *(__int128*)&n)) {
+    mem_free(b);
+    return false;
+  }
+  segments = 1;
+  delta->footprint += (ssize_t)mem_footprint(b, b) -
+    mem_footprint(p.head, p.tail);
+  mem_gc_free(p.head);
+  return true;
 }
 
 void
@@ -184,5 +500,29 @@ entry::touch(uint32_t exptime)
 size_t
 entry::size() const
 {
-  return mem_size(data.head, nullptr);
+  const mem *head = data.head;
+  if (head == nullptr)
+    return inline_size;
+  return value_size(head, nullptr);
+}
+
+segment_state
+entry::placement() const
+{
+  segment_state worst = segment_state::none;
+  for (const mem *m = data.head; m; m = m->next) {
+    segment_state s = segment_state_of(m);
+    if (s == segment_state::evicting)
+      return s;
+    if (s == segment_state::cleaning ||
+        (s != segment_state::none && worst == segment_state::none))
+      worst = s;
+  }
+  return worst;
+}
+
+size_t
+entry::footprint() const
+{
+  return slab_usable_size(this) + mem_footprint(data.head, nullptr);
 }
@@ -4,6 +4,7 @@
 #include <functional>
 
 #include "gc.h"
+#include "segment.h"
 #include "const_rope.h"
 #include "flagged_ptr.h"
 #include "history.h"
@@ -17,37 +18,121 @@ struct mem_pair
   mem_pair(mem *head, mem *tail) : head(head), tail(tail) { }
 };
 
+// How an operation changed the memory held by an entry's value.
+struct value_delta
+{
+  ssize_t bytes = 0;            // payload
+  ssize_t footprint = 0;        // allocated, mem headers included
+};
+
+// Allocate a new CAS unique. Values are unique across all threads and
+// increase monotonically within a thread.
+uint64_t cas_unique_next();
+
 class entry : public gc_object, public mv_object<entry>
 {
-  uint32_t flags;
-  uint32_t exptime;
+  // Ordered to avoid padding: data must be aligned, and directly
+  // follows the bases.
   mem_pair data __attribute__((aligned(sizeof(struct mem_pair))));
+  std::atomic<uint64_t> version;  // CAS unique, bumped on every write
   timestamp atime;
   timestamp mtime;
-  bool deleted;                 // XXX - for debugging
+  std::atomic<uint32_t> segments; // mem's in data, roughly
+  uint32_t flags;
+  uint32_t exptime;
+  uint8_t inline_size;          // if data is null, see inline_data()
+#ifndef NDEBUG
+  bool deleted;
+#endif
 
-  uint64_t incrdecr(std::function<uint64_t (uint64_t)> doit);
+  bool incrdecr(std::function<uint64_t (uint64_t)> doit,
+                value_delta *delta, uint64_t *out);
+  bool rewrite(value_delta *delta, bool always);
+  // Set in version while a write changes the value in place.
+  static constexpr uint64_t version_writing = (uint64_t)1 << 63;
+  uint64_t claim_version();
+  void release_version(uint64_t v);
+  void drop();
+  void uninline(value_delta *delta);
+  void decompress(value_delta *delta);
+  const char *inline_data() const {
+    return reinterpret_cast<const char *>(this + 1);
+  }
+  entry(uint32_t flags, uint32_t exptime, const mem *m);
   entry(const entry &);            // No copies
   entry & operator=(const entry&); // No assignment
 
  public:
+  // Values up to this size are copied into the entry itself, where
+  // they need no mem and no pointer chase to read. The value moves to
+  // a mem chain when it is appended to, prepended to or incremented.
+  static constexpr size_t inline_max = 64;
 
   entry(uint32_t flags, uint32_t exptime, const rope &r)
-    : flags(flags), exptime(exptime),
-      data(r.head(), r.tail()), deleted(false) {}
+    : gc_object(gc_kind_of<entry>()), data(r.head(), r.tail()),
+      version(cas_unique_next()), segments(r.segments()), flags(flags),
+      exptime(exptime), inline_size(0)
+#ifndef NDEBUG
+    , deleted(false)
+#endif
+  { }
   ~entry();
-  void append(const rope &r);
-  void prepend(const rope &r);
-  bool cas(uint32_t flags, uint32_t exptime, uint64_t version, const rope &r);
+  // Whether r would be stored inline. Not with log storage, whose
+  // values must stay in segments, nor if compressed.
+  static bool inlines(const rope &r) {
+    return r.head() == r.tail() && r.head()->size <= (int)inline_max &&
+      !segment_enabled() && !mem_compressed(r.head());
+  }
+  // Bytes needed for an entry holding r.
+  static size_t alloc_size(const rope &r) {
+    return sizeof(entry) + (inlines(r) ? r.head()->size : 0);
+  }
+  // Construct an entry for r in memory of alloc_size(r) bytes. An
+  // inline value is copied and r freed.
+  static entry *place(void *p, uint32_t flags, uint32_t exptime,
+                      const rope &r);
+  static entry *alloc(uint32_t flags, uint32_t exptime, const rope &r);
+  void append(const rope &r, value_delta *delta);
+  void prepend(const rope &r, value_delta *delta);
+  bool cas(uint32_t flags, uint32_t exptime, uint64_t unique, const rope &r,
+           value_delta *delta);
+  // Copy a fragmented value into a single mem, compressing it if
+  // that is enabled. Returns false if there was nothing to do or we
+  // lost a race with a writer.
+  bool coalesce(value_delta *delta);
+  // Like coalesce(), but copies even a single mem, to move the value
+  // out of a segment being cleaned.
+  bool relocate(value_delta *delta);
 
-  uint64_t incr(uint64_t v);
-  uint64_t decr(uint64_t v);
+  // Return false, changing nothing, if the value isn't a number.
+  bool incr(uint64_t v, value_delta *delta, uint64_t *out);
+  bool decr(uint64_t v, value_delta *delta, uint64_t *out);
   void touch(uint32_t exptime);
   uint32_t get_flags() const { return flags; }
   uint32_t get_exptime() const { return exptime; }
+  uint64_t get_version() const { return version & ~version_writing; }
   time_t get_atime() const { return atime; }
   time_t get_mtime() const { return mtime; }
-  const_rope read();            // Updates atime
+  // Updates atime. Returns false, dropping the entry, if the value is
+  // corrupt.
+  bool read(const_rope *r);
   size_t size() const;
+  // Memory held by the entry and its value.
+  size_t footprint() const;
+  size_t gc_size() const { return footprint(); }
+  uint32_t get_segments() const { return segments; }
+  // Where the value lives: evicting if any part of it is in a
+  // segment being evicted, otherwise cleaning if any part is in one
+  // being cleaned, otherwise sealed or open if any part is in a
+  // segment, and none if it's all elsewhere.
+  segment_state placement() const;
   bool expired() const;         // XXX - unused
 };
+
+// Per item budget for the entry header, which with many small items
+// is most of the memory. Debug builds add a few checking fields.
+#ifdef NDEBUG
+static_assert(sizeof(entry) <= 64, "entry over budget");
+#else
+static_assert(sizeof(entry) <= 80, "entry over budget");
+#endif
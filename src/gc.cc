@@ -3,214 +3,681 @@
  * Objects can be garbage collected when its guaranteed that no thread
  * has a reference to the object.
  *
- * GC objects transiton through a lattice of states each time they are
- * observed by a CPU as having been freed. When all CPUs have observed
- * that the object is freed (top), delete is invoked on the object.
+ * This is epoch based, quiescent state reclamation. Time is divided
+ * into epochs. Every online thread announces the epoch it saw at its
+ * last checkpoint, and the epoch advances once all threads online
+ * when it began have checkpointed in it. Rather than scanning every
+ * thread for that, the epoch starts with a count of laggards, which
+ * each thread decrements at its first checkpoint in the epoch, so a
+ * checkpoint costs O(1) however many threads there are.
  *
- * When gc_free() is called, the object is placed on a pending queue,
- * private to the invoking CPU, in the order which it was freed.  We
- * can infer that an object was observed by a CPU if an object freed
- * later than it was observed by that CPU.
+ * gc_free() puts an object on a list private to the freeing thread,
+ * one per epoch, stamped with the epoch it was freed in. Two epochs
+ * later every thread has checkpointed since it was freed, and the
+ * thread deletes the list at its next checkpoint. Only the three
+ * most recent epochs can have undeleted objects, so three lists do.
+ * A thread exiting with objects still pending hands its lists to
+ * whichever thread checkpoints next.
+ *
+ * A thread waiting for work parks: it goes offline, so the epoch can
+ * advance without it, and comes back online when it next touches
+ * collected objects. It keeps its lists, to delete once back, so
+ * parking costs one lock and unparking another. With a limit on
+ * pending bytes set, threads checkpoint between requests while it's
+ * exceeded, and parked threads' lists are handed over as if they had
+ * exited. The total is kept loosely, each thread adding its share in
+ * batches.
+ *
+ * gc_flush_async() callbacks wait for an epoch, and are called by
+ * whichever thread starts it, after dropping the lock. With no
+ * thread online nothing can hold a reference, so the epoch then
+ * advances straight to the one awaited.
+ *
+ * Deleting a list can take a while: an entry frees its whole value.
+ * With gc_start_reclaimer() lists ready to delete are queued for a
+ * low priority thread instead, so checkpoints cost the same however
+ * much was freed.
  */
 #include "gc.h"
 #include <cstddef>
 #include <cassert>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "counter.h"
+
+namespace {
+
+constexpr int nlimbo = 3;
+// Pending bytes a thread adds to or takes from the total at once.
+constexpr ssize_t publish_bytes = 64 << 10;
+
+typedef std::chrono::steady_clock clock;
 
-class gc_flush_control
+// Objects freed in one epoch.
+struct limbo
 {
-private:
+  uint64_t epoch = 0;
+  gc_object *head = nullptr;
+  size_t objects = 0;
+  size_t bytes = 0;
+  clock::time_point since;      // when the first was freed
+};
 
-  class waiter
-  {
-  private:
-    std::unique_lock<std::mutex> lock;
-    cpu_mask_t seen;
-    int id;
-    std::condition_variable ready;
-    waiter *next;
-  public:
-    waiter(std::mutex &m)
-      : lock(m), seen(0), id(cpu_id()), next(nullptr) { }
-    waiter *get_next() const { return next; }
-    void append(waiter *w) {
-      if (next != nullptr)
-        next->append(w);
-      else
-        next = w;
-    }
-    void wait() {
-      while (!cpu_seen_all(seen))
-        ready.wait(lock);
-    }
-    void checkpoint() {
-      seen |= 1ULL << cpu_id();
-      if (cpu_seen_all(seen))
-        ready.notify_all();
+std::atomic<uint64_t> global_epoch(2); // so that epoch - 2 is never negative
+std::atomic<size_t> laggards(0);       // online threads yet to checkpoint
+size_t nonline = 0;             // guarded by control_lock
+std::mutex control_lock;
+std::condition_variable advanced;
 
-      if (next != nullptr)
-        next->checkpoint();
-    }
-  };
-
-  std::atomic<waiter *> flushes; // Pending flushes, oldest to youngest
-  std::mutex mutex;
-  void checkpoint_locked();
-  
-public:
-  gc_flush_control() : flushes(nullptr) { }
+// gc_flush_async() callbacks and the epochs they wait for, guarded by
+// control_lock.
+typedef std::vector<std::function<void ()>> callbacks;
+std::vector<std::pair<uint64_t, std::function<void ()>>> waiters;
+
+// Lists left by exiting threads, guarded by control_lock.
+std::vector<limbo> orphans;
+std::atomic<size_t> orphan_objects(0);
+std::atomic<size_t> orphan_bytes(0);
+
+// Lists queued for the reclaimer thread. It runs until exit, so this
+// is never deleted, and not destroyed under it.
+struct reclaim_queue
+{
+  std::mutex lock;
+  std::condition_variable queued;
+  std::condition_variable drained;
+  std::vector<limbo> lists;
+};
+std::atomic<reclaim_queue *> reclaimer(nullptr);
+std::atomic<size_t> queue_objects(0);
+std::atomic<size_t> queue_bytes(0);
+counter destroyed_objects;
+counter destroyed_bytes;
+
+std::atomic<size_t> limit(0);           // on pending bytes, if not 0
+std::atomic<ssize_t> pending_total(0);  // as published by threads
+counter forced;
+
+gc_kind kinds[gc_max_kinds];
+std::atomic<int> nkinds(0);
+
+gc_thread *threads = nullptr;   // all threads that used the collector
+
+}
+
+struct gc_thread
+{
+  uint64_t epoch = 0;           // of the last checkpoint, if online
+  bool online = false;
+  bool parked = false;          // guarded by control_lock
+  limbo lists[nlimbo];
+  ssize_t unpublished = 0;      // pending bytes not in pending_total
+  // Only updated by the owning thread; others just read them.
+  std::atomic<size_t> pending_objects;
+  std::atomic<size_t> pending_bytes;
+  std::atomic<clock::rep> oldest; // since of the oldest list, or 0
+  gc_thread *prev = nullptr;
+  gc_thread *next = nullptr;
+
+  gc_thread();
+  ~gc_thread();
+  void push(gc_object *o);
+  void reclaim(uint64_t now);
   void checkpoint();
-  void force_checkpoint();
-  void flush();
+  void go_offline(bool park = false);
+  void hand_over_locked();
+  void add_pending(ssize_t objects, ssize_t bytes);
+  void update_oldest();
+  static void destroy(limbo &l);
+  static void dispose(limbo &l);
 };
 
-void gc_flush_control::flush()
+namespace {
+
+thread_local gc_thread self;
+
+bool
+awaited(uint64_t e)
 {
-  gc_checkpoint();
-  waiter w(mutex);
-  waiter *head = flushes;
-  if (head == nullptr) {
-    flushes = &w;
-  } else {
-    head->append(&w);
+  for (auto &w : waiters) {
+    if (w.first > e)
+      return true;
   }
-  checkpoint_locked();
-  w.wait();
-  // XXX - flushes might not be &w!
-  flushes = w.get_next();
+  return false;
 }
 
-void gc_flush_control::checkpoint_locked()
+// Start the next epoch, unless someone else did, or threads have yet
+// to checkpoint in this one, and move the callbacks it satisfies to
+// ready, to be called without the lock. Call with control_lock held.
+void
+advance_locked(uint64_t e, callbacks &ready)
 {
-  waiter *w = flushes;
-  if (w != nullptr) 
-    w->checkpoint();
+  if (global_epoch.load() != e || laggards.load() != 0)
+    return;
+  do {
+    laggards = nonline;
+    global_epoch.store(++e, std::memory_order_release);
+  } while (nonline == 0 && awaited(e));
+  for (size_t i = 0; i < waiters.size(); ) {
+    if (waiters[i].first <= e) {
+      ready.push_back(std::move(waiters[i].second));
+      waiters[i] = std::move(waiters.back());
+      waiters.pop_back();
+    } else {
+      ++i;
+    }
+  }
+  advanced.notify_all();
 }
 
-void gc_flush_control::force_checkpoint()
+void
+call(callbacks &ready)
 {
-  std::unique_lock<std::mutex> lock(mutex);
-  checkpoint_locked();
+  for (auto &f : ready)
+    f();
 }
 
-void gc_flush_control::checkpoint()
+void
+advance(uint64_t e)
 {
-  if (flushes.load(std::memory_order_relaxed) == nullptr)
+  callbacks ready;
+  {
+    std::lock_guard<std::mutex> l(control_lock);
+    advance_locked(e, ready);
+  }
+  call(ready);
+}
+
+// Delete orphaned lists which are old enough.
+void
+reclaim_orphans(uint64_t now)
+{
+  if (orphan_objects.load(std::memory_order_relaxed) == 0)
     return;
-  force_checkpoint();
+  std::vector<limbo> ready;
+  {
+    std::lock_guard<std::mutex> l(control_lock);
+    for (size_t i = 0; i < orphans.size(); ) {
+      if (orphans[i].epoch + 2 <= now) {
+        ready.push_back(orphans[i]);
+        orphans[i] = orphans.back();
+        orphans.pop_back();
+      } else {
+        ++i;
+      }
+    }
+  }
+  for (limbo &l : ready) {
+    orphan_objects -= l.objects;
+    orphan_bytes -= l.bytes;
+    gc_thread::dispose(l);
+  }
+}
+
+void
+reclaimer_main(reclaim_queue *q)
+{
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+  std::unique_lock<std::mutex> l(q->lock);
+  while (true) {
+    q->queued.wait(l, [q]() { return !q->lists.empty(); });
+    std::vector<limbo> batch;
+    batch.swap(q->lists);
+    l.unlock();
+    for (limbo &b : batch) {
+      size_t objects = b.objects, bytes = b.bytes;
+      gc_thread::destroy(b);
+      queue_objects -= objects;
+      queue_bytes -= bytes;
+    }
+    l.lock();
+    if (q->lists.empty())
+      q->drained.notify_all();
+  }
 }
 
-class gc_cpu
+}
+
+gc_thread::gc_thread()
+  : pending_objects(0), pending_bytes(0), oldest(0)
 {
-private:
-  std::atomic<gc_object *> pending;
-  gc_object *last_observed[MAX_CPUS]; // XXX
-  friend gc_object;
+  std::lock_guard<std::mutex> l(control_lock);
+  next = threads;
+  if (threads)
+    threads->prev = this;
+  threads = this;
+}
 
-  gc_object * pop_ready();
-public:
-  gc_cpu() : pending(nullptr), last_observed {} { }
-  void service();
-  gc_object *observe(int cpu, gc_object *unless);
-  void checkpoint(int cpu);
-};                              // XXX - cache aligned
+gc_thread::~gc_thread()
+{
+  {
+    // Our lists are our own again.
+    std::lock_guard<std::mutex> l(control_lock);
+    parked = false;
+  }
+  checkpoint();
+  go_offline();
+  std::lock_guard<std::mutex> l(control_lock);
+  hand_over_locked();
+  if (prev)
+    prev->next = next;
+  else
+    threads = next;
+  if (next)
+    next->prev = prev;
+}
 
-static gc_cpu cpus[MAX_CPUS];
-static gc_flush_control flushes;
+// Make our lists orphans, for other threads to delete. Call with
+// control_lock held, from the owning thread or for a parked one.
+void
+gc_thread::hand_over_locked()
+{
+  for (limbo &list : lists) {
+    if (list.head == nullptr)
+      continue;
+    orphans.push_back(list);
+    orphan_objects += list.objects;
+    orphan_bytes += list.bytes;
+    add_pending(-(ssize_t)list.objects, -(ssize_t)list.bytes);
+    list.epoch = 0;
+    list.head = nullptr;
+    list.objects = list.bytes = 0;
+  }
+  update_oldest();
+}
 
-gc_object *
-gc_cpu::pop_ready()
+void
+gc_thread::add_pending(ssize_t objects, ssize_t bytes)
 {
-  cpu_mask_t seen = 0;
-  std::atomic<gc_object*> *at = &pending;
-  while (true) {
-    gc_object *t = *at;
-    if (t == nullptr)
-      return nullptr;
-    seen |= t->seen;
-    if (cpu_seen_all(seen)) {
-      *at = nullptr;
-      return t;
-    }
-    at = &t->next;
+  pending_objects.store(pending_objects.load(std::memory_order_relaxed) +
+                        objects, std::memory_order_relaxed);
+  pending_bytes.store(pending_bytes.load(std::memory_order_relaxed) + bytes,
+                      std::memory_order_relaxed);
+  unpublished += bytes;
+  if (unpublished >= publish_bytes || unpublished <= -publish_bytes) {
+    pending_total += unpublished;
+    unpublished = 0;
   }
 }
 
 void
-gc_cpu::service()
+gc_thread::update_oldest()
 {
-  gc_object *ready = pop_ready();
-  if (ready == nullptr)
+  clock::rep t = 0;
+  for (limbo &l : lists) {
+    if (l.head && (t == 0 || l.since.time_since_epoch().count() < t))
+      t = l.since.time_since_epoch().count();
+  }
+  oldest.store(t, std::memory_order_relaxed);
+}
+
+void
+gc_thread::destroy(limbo &l)
+{
+  gc_object *o = l.head;
+  l.head = nullptr;
+  while (o) {
+    gc_object *next = static_cast<gc_object *>(slab_expand(o->next));
+#ifndef NDEBUG
+    assert(o->dispatched == false);
+    o->dispatched = true;
+#endif
+    kinds[o->kind].destroy(o);
+    o = next;
+  }
+  destroyed_objects += l.objects;
+  destroyed_bytes += l.bytes;
+}
+
+// Delete a list, or have the reclaimer do it.
+void
+gc_thread::dispose(limbo &l)
+{
+  reclaim_queue *q = reclaimer.load(std::memory_order_acquire);
+  if (q == nullptr) {
+    destroy(l);
     return;
+  }
+  queue_objects += l.objects;
+  queue_bytes += l.bytes;
+  std::lock_guard<std::mutex> g(q->lock);
+  q->lists.push_back(l);
+  q->queued.notify_one();
+}
 
-  while (ready) {
-    gc_object *next = ready->next;
-    assert(ready->dispatched == false);
-    ready->dispatched = true;
-    delete ready;
-    ready = next;
+// Objects on a thread's lists were freed by that thread, and are also
+// deleted by it, so their memory goes back to this thread's slab
+// magazines in one batch.
+void
+gc_thread::reclaim(uint64_t now)
+{
+  for (limbo &l : lists) {
+    if (l.head == nullptr || l.epoch + 2 > now)
+      continue;
+    limbo ready = l;
+    l.head = nullptr;
+    l.objects = l.bytes = 0;
+    add_pending(-(ssize_t)ready.objects, -(ssize_t)ready.bytes);
+    update_oldest();
+    dispose(ready);
+  }
+}
+
+void
+gc_thread::push(gc_object *o)
+{
+  uint64_t e = global_epoch.load(std::memory_order_acquire);
+  limbo &l = lists[e % nlimbo];
+  if (l.epoch != e) {
+    // Three epochs old, so ready.
+    if (l.head)
+      reclaim(e);
+    l.epoch = e;
+    l.since = clock::now();
+    if (oldest.load(std::memory_order_relaxed) == 0)
+      oldest.store(l.since.time_since_epoch().count(),
+                   std::memory_order_relaxed);
   }
+  o->next = slab_compress(l.head);
+  l.head = o;
+  size_t bytes = o->pending_units * gc_object::pending_unit;
+  l.objects++;
+  l.bytes += bytes;
+  add_pending(1, bytes);
+}
+
+void
+gc_thread::checkpoint()
+{
+  uint64_t e = global_epoch.load(std::memory_order_acquire);
+  if (online && epoch != e) {
+    // Our first checkpoint this epoch: it can't advance without us.
+    epoch = e;
+    if (laggards.fetch_sub(1) == 1)
+      advance(e);
+  } else if (laggards.load(std::memory_order_relaxed) == 0) {
+    advance(e);
+  }
+  uint64_t now = global_epoch.load(std::memory_order_acquire);
+  reclaim(now);
+  reclaim_orphans(now);
+}
+
+void
+gc_thread::go_offline(bool park)
+{
+  callbacks ready;
+  {
+    std::lock_guard<std::mutex> l(control_lock);
+    if (!online)
+      return;
+    online = false;
+    nonline--;
+    if (park) {
+      parked = true;
+      if (gc_over_limit())
+        hand_over_locked();
+    }
+    // Still counted in this epoch's laggards unless it checkpointed.
+    uint64_t e = global_epoch.load();
+    if (epoch != e && laggards.fetch_sub(1) == 1)
+      advance_locked(e, ready);
+    else if (nonline == 0 && laggards.load() == 0)
+      advance_locked(e, ready);   // for gc_flush_async() waiters
+  }
+  call(ready);
+}
+
+int
+gc_kind_register(gc_kind kind)
+{
+  int id = nkinds++;
+  assert(id < gc_max_kinds);
+  kinds[id] = kind;
+  return id;
 }
 
 void
 gc_object::gc_free()
 {
+#ifndef NDEBUG
   assert(scheduled == false);
   scheduled = true;
-  gc_cpu &mycpu = cpus[cpu_id()];
-  gc_object *sub = mycpu.pending;
-  set_next(sub);
-  mycpu.pending = this;
+#endif
+  size_t units = (kinds[kind].size(this) + pending_unit - 1) / pending_unit;
+  pending_units = units;
+  self.push(this);
 }
 
 void
-gc_object::observe(int cpu)
+gc_thread_online()
 {
-  seen |= (1 << cpu);
+  gc_thread &t = self;          // constructed outside the lock
+  std::lock_guard<std::mutex> l(control_lock);
+  t.parked = false;
+  if (t.online)
+    return;
+  // Not a laggard in the current epoch: anything it reads now was
+  // freed no earlier than this.
+  t.online = true;
+  t.epoch = global_epoch.load();
+  nonline++;
+}
+
+void
+gc_thread_offline()
+{
+  self.go_offline();
 }
 
-// XXX - This is broken.  unless might have been recycled, in which
-// case we would want to observe it.
-gc_object *
-gc_cpu::observe(int cpu, gc_object *unless)
+void
+gc_park()
 {
-  gc_object *head = pending;
-  if (head != nullptr && head != unless)
-    head->observe(cpu);
-  return head;
+  gc_thread &t = self;
+  t.checkpoint();
+  t.go_offline(true);
 }
 
-// XXX - gc_cpu has to be told its id? 
 void
-gc_cpu::checkpoint(int cpu)
+gc_unpark()
 {
-  // XXX -why not cpu_count()?
-  for (int i = 0; i < MAX_CPUS; ++i)
-    last_observed[i] = cpus[i].observe(cpu, last_observed[i]);
-  service();
+  // Only other threads holding control_lock touch parked while we are
+  // parked, and they never clear it.
+  if (self.parked)
+    gc_thread_online();
 }
 
 void
 gc_checkpoint()
 {
-  cpus[cpu_id()].checkpoint(cpu_id());
-  flushes.checkpoint();
+  self.checkpoint();
+}
+
+void
+gc_set_limit(size_t bytes)
+{
+  limit = bytes;
+}
+
+bool
+gc_over_limit()
+{
+  size_t l = limit.load(std::memory_order_relaxed);
+  return l && pending_total.load(std::memory_order_relaxed) +
+    (ssize_t)orphan_bytes.load(std::memory_order_relaxed) +
+    (ssize_t)queue_bytes.load(std::memory_order_relaxed) > (ssize_t)l;
+}
+
+void
+gc_relieve()
+{
+  if (gc_over_limit()) {
+    ++forced;
+    {
+      // Parked threads would keep theirs until they wake.
+      std::lock_guard<std::mutex> l(control_lock);
+      for (gc_thread *t = threads; t; t = t->next)
+        if (t->parked)
+          t->hand_over_locked();
+    }
+    gc_checkpoint();
+  }
 }
 
 void
 gc_flush()
 {
-  flushes.flush();
+  uint64_t target = global_epoch.load() + 2;
+  while (true) {
+    gc_checkpoint();
+    uint64_t e = global_epoch.load();
+    if (e >= target)
+      break;
+    // Wait for the others, unless there are none or we are one.
+    gc_thread &t = self;
+    std::unique_lock<std::mutex> l(control_lock);
+    advanced.wait(l, [&]() {
+        return global_epoch.load() != e || laggards.load() == 0 ||
+          (t.online && t.epoch != e);
+      });
+  }
+  gc_checkpoint();
+}
+
+void
+gc_flush_async(std::function<void ()> done)
+{
+  callbacks ready;
+  {
+    std::lock_guard<std::mutex> l(control_lock);
+    uint64_t e = global_epoch.load();
+    waiters.emplace_back(e + 2, std::move(done));
+    if (laggards.load() == 0)
+      advance_locked(e, ready);
+  }
+  call(ready);
+}
+
+size_t
+gc_pending_objects()
+{
+  std::lock_guard<std::mutex> l(control_lock);
+  size_t n = orphan_objects + queue_objects;
+  for (gc_thread *t = threads; t; t = t->next)
+    n += t->pending_objects;
+  return n;
+}
+
+size_t
+gc_pending_bytes()
+{
+  std::lock_guard<std::mutex> l(control_lock);
+  size_t n = orphan_bytes + queue_bytes;
+  for (gc_thread *t = threads; t; t = t->next)
+    n += t->pending_bytes;
+  return n;
+}
+
+size_t
+gc_oldest_pending_ms()
+{
+  clock::rep t = 0;
+  {
+    std::lock_guard<std::mutex> l(control_lock);
+    for (const limbo &o : orphans) {
+      clock::rep since = o.since.time_since_epoch().count();
+      if (t == 0 || since < t)
+        t = since;
+    }
+    for (gc_thread *th = threads; th; th = th->next) {
+      clock::rep since = th->oldest.load(std::memory_order_relaxed);
+      if (since && (t == 0 || since < t))
+        t = since;
+    }
+  }
+  if (reclaim_queue *q = reclaimer.load()) {
+    std::lock_guard<std::mutex> l(q->lock);
+    for (const limbo &list : q->lists) {
+      clock::rep since = list.since.time_since_epoch().count();
+      if (t == 0 || since < t)
+        t = since;
+    }
+  }
+  if (t == 0)
+    return 0;
+  clock::duration age = clock::now() - clock::time_point(clock::duration(t));
+  return std::chrono::duration_cast<std::chrono::milliseconds>(age).count();
+}
+
+uint64_t
+gc_forced_checkpoints()
+{
+  return forced;
+}
+
+uint64_t
+gc_epoch()
+{
+  return global_epoch.load(std::memory_order_relaxed);
 }
 
 void
 gc_finish()
 {
-  for (int i = 0; i < cpu_count(); ++i)
-    cpus[i].checkpoint(i);
-  for (int i = 0; i < cpu_count(); ++i)
-    cpus[i].checkpoint(i);
+  gc_flush();
+  gc_flush();
+  if (reclaim_queue *q = reclaimer.load()) {
+    std::unique_lock<std::mutex> l(q->lock);
+    q->drained.wait(l, []() { return queue_objects.load() == 0; });
+  }
+}
+
+void
+gc_start_reclaimer()
+{
+  reclaim_queue *q = new reclaim_queue();
+  reclaim_queue *none = nullptr;
+  if (!reclaimer.compare_exchange_strong(none, q)) {
+    delete q;
+    return;
+  }
+  std::thread(reclaimer_main, q).detach();
+}
+
+bool
+gc_reclaimer_enabled()
+{
+  return reclaimer.load(std::memory_order_relaxed) != nullptr;
+}
+
+uint64_t
+gc_destroyed_objects()
+{
+  return destroyed_objects;
+}
+
+uint64_t
+gc_destroyed_bytes()
+{
+  return destroyed_bytes;
+}
+
+size_t
+gc_reclaim_queue_objects()
+{
+  return queue_objects;
+}
+
+size_t
+gc_reclaim_queue_bytes()
+{
+  return queue_bytes;
 }
 
 void
@@ -218,8 +685,6 @@ gc_exit()
 {
   gc_checkpoint();
   cpu_exit();
-  gc_checkpoint();
-  flushes.force_checkpoint();
 }
 
 static thread_local int gc_thread_locked = 0;
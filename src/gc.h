@@ -1,51 +1,133 @@
 #include "cpu.h"
+#include "slab.h"
 #include <atomic>
 #include <functional>
 #include <cassert>
 
-class gc_cpu;
+struct gc_thread;
+class gc_object;
 
-// Derive from this class to make a garbage collected object. Call
-// gc_free() method to schedule for deletion.
+// Collected objects have no vtable, to keep their header small.
+// Instead each class is registered as a kind, which knows how to
+// delete and measure its objects. See gc_kind_of().
+struct gc_kind
+{
+  void (*destroy)(gc_object *o);
+  size_t (*size)(const gc_object *o);
+};
+constexpr int gc_max_kinds = 16;
+int gc_kind_register(gc_kind kind);
+
+// Derive from this class to make a garbage collected object, passing
+// gc_kind_of<Derived>() to its constructor. Call gc_free() method to
+// schedule for deletion. Objects must be slab allocated, as the
+// header is a single word: a slab_ref for the list of freed objects,
+// the kind and the size.
 class gc_object
 {
 private:
-  // List of objects waiting to be seen.
-  std::atomic<gc_object *> next;
-  // Mask of cpus which have seen this object.
-  std::atomic<cpu_mask_t> seen;
-  bool scheduled;               // XXX - debugging
-  bool dispatched;              // XXX - debugging
-
-  friend gc_cpu;
+  slab_ref next;                // objects freed in the same epoch
+  uint32_t kind : 4;
+  uint32_t pending_units : 28;  // gc_size() when freed, in units
+#ifndef NDEBUG
+  bool scheduled;
+  bool dispatched;
+#endif
 
-  // Update seen state.
-  void observe(int cpu);
+  friend gc_thread;
 
   gc_object(const gc_object &) = delete;
 
-  void set_next(gc_object *nxt) {
-    assert(nxt == nullptr || nxt > (void*)0x1000);
-    next = nxt;
-  }
+protected:
+  // Only deleted as the derived class, by the collector or its owner.
+  ~gc_object() { }
 
 public:
-  gc_object() : next(nullptr), seen(0),
-                scheduled(false), dispatched(false) { }
-  virtual ~gc_object() { }
+  static constexpr size_t pending_unit = 16;
+
+  explicit gc_object(int kind)
+    : next(0), kind(kind), pending_units(0)
+#ifndef NDEBUG
+    , scheduled(false), dispatched(false)
+#endif
+  { }
+
+  // Memory held by this object, counted while it awaits collection.
+  // Derived classes hide this to count more.
+  size_t gc_size() const { return slab_usable_size(this); }
+
+  // Collected objects live in slab memory.
+  static void *operator new(size_t size) { return slab_alloc(size); }
+  static void operator delete(void *p) { slab_free(p); }
 
   void gc_free();
 };
 
+template <class T>
+int
+gc_kind_of()
+{
+  static const int id = gc_kind_register({
+      [](gc_object *o) { delete static_cast<T *>(o); },
+      [](const gc_object *o) { return static_cast<const T *>(o)->gc_size(); }
+    });
+  return id;
+}
+
+// Threads reading collected objects come online with cpu_init(),
+// and must then checkpoint regularly; see gc.cc. Threads which don't
+// are not waited for.
+void gc_thread_online();
+void gc_thread_offline();
+
+// Called by a thread about to wait for work, holding no references:
+// it goes offline until gc_unpark(), which must be called before
+// touching collected objects again and does nothing unless parked.
+void gc_park();
+void gc_unpark();
+
 // Called periodically by threads to notify that they are not
 // referencing any gc objects.
 void gc_checkpoint();
-// Block until all threads have checkpointed.
+
+// Limit the bytes pending collection, 0 for none. While the limit is
+// exceeded gc_relieve() checkpoints; threads call it between requests.
+void gc_set_limit(size_t bytes);
+bool gc_over_limit();
+void gc_relieve();
+// Block until everything freed so far can be deleted, and delete
+// what the calling thread freed.
 void gc_flush();
+// Call done once everything freed so far can be deleted, from
+// whichever thread's checkpoint gets there, or before returning.
+// Keep it short; it can hand work to another thread.
+void gc_flush_async(std::function<void ()> done);
+
+// Objects freed but not yet deleted, and the memory they hold.
+size_t gc_pending_objects();
+size_t gc_pending_bytes();
+// Time since the oldest pending object was freed.
+size_t gc_oldest_pending_ms();
+// Checkpoints made by gc_relieve().
+uint64_t gc_forced_checkpoints();
+uint64_t gc_epoch();
 
+// Checkpoint and go offline, at thread exit.
 void gc_exit();
 
+// Delete everything still pending, once other threads are gone.
 void gc_finish();
 
+// Start a low priority thread to delete objects, instead of the
+// threads that freed them doing so at their checkpoints.
+void gc_start_reclaimer();
+bool gc_reclaimer_enabled();
+// Objects deleted since startup, and the memory they held; and lists
+// of them queued for the reclaimer thread.
+uint64_t gc_destroyed_objects();
+uint64_t gc_destroyed_bytes();
+size_t gc_reclaim_queue_objects();
+size_t gc_reclaim_queue_bytes();
+
 void gc_lock();
 void gc_unlock();
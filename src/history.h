@@ -8,7 +8,8 @@ class mv_object {
   T *tail(T *end);
  public:
   mv_object() : newer_(nullptr) { }
-  virtual ~mv_object();
+  // Not virtual: T is never deleted through its mv_object base.
+  ~mv_object();
   void mv_set(T *e);
   bool mv_add(T *e);
   bool mv_replace(T *e);
@@ -6,9 +6,15 @@
 #include "service.h"
 #include "utils.h"
 #include "log.h"
+#include "numa.h"
+#include "dedup.h"
+#include "compress.h"
 
 #include <algorithm>
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
 #include <cassert>
 #include <unistd.h>
 #include <err.h>
@@ -19,7 +25,20 @@ static int tcp_port = 11211;
 static int listen_backlog = 1024;
 static bool daemonize = false;
 static int max_memory_mb = 64;
+// -m may use up to this fraction of the slab region.
+static constexpr double region_use = 0.875;
 static int num_threads = 4;
+static double slab_factor = 1.25;
+static int slab_min_chunk = 48;
+static bool large_pages = false;
+static bool log_storage = false;
+static size_t dedup_min = 0;
+static size_t compress_min = 0;
+static size_t gc_limit = 0;
+static bool reclaimer = false;
+static bool numa = false;
+static const char *numa_cpus = nullptr;
+static int service_cpu = -1;
 
 using std::cout;
 using std::endl;
@@ -37,16 +56,82 @@ void usage()
     "-vvv     extremely verbose (also print internal state transitions)",
     "-h       print this help and exit",
     "-t <num> number of threads to use (default: 4)",
+    "-f <factor> chunk size growth factor (default: 1.25)",
+    "-n <bytes> minimum space allocated for key+value+flags (default: 48)",
+    "-L       Try to use large memory pages (if available), and",
+    "         preallocate the item memory",
+    "-o <opt> comma separated extended options:",
+    "         log_storage  store values in log structured segments",
+    "         dedup[=<bytes>] store equal values of at least this size",
+    "                      once (default: 1024)",
+    "         compress[=<bytes>] compress values of at least this size",
+    "                      (default: 4096)",
+    "         numa         pin threads and place memory by NUMA node",
+    "         cpus=<list>  pin io threads to these cpus in turn, e.g.",
+    "                      0-3:8-11 (implies numa)",
+    "         service_cpu=<num> pin the service thread (implies numa)",
+    "         gc_limit=<num> checkpoint eagerly while more than this many",
+    "                      megabytes of garbage are pending",
+    "         reclaimer    delete garbage on a background thread",
     NULL
   };
   for (int i = 0; usage_msg[i]; ++i)
     cout << usage_msg[i] << endl;
 }
 
+// A minimum value size for dedup= or compress=.
+size_t
+parse_min_size(const char *what, const char *s)
+{
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(s, &end, 10);
+  if (!isdigit((unsigned char)*s) || *end != '\0' || errno != 0 || n == 0) {
+    fprintf(stderr, "%s size must be a number greater than 0\n", what);
+    exit(2);
+  }
+  return n;
+}
+
+void
+parse_extended(char *opts)
+{
+  char *save;
+  for (char *o = strtok_r(opts, ",", &save); o;
+       o = strtok_r(nullptr, ",", &save)) {
+    if (strcmp(o, "log_storage") == 0) {
+      log_storage = true;
+    } else if (strcmp(o, "dedup") == 0) {
+      dedup_min = dedup_default_min;
+    } else if (strncmp(o, "dedup=", 6) == 0) {
+      dedup_min = parse_min_size("Dedup", o + 6);
+    } else if (strcmp(o, "compress") == 0) {
+      compress_min = compress_default_min;
+    } else if (strncmp(o, "compress=", 9) == 0) {
+      compress_min = parse_min_size("Compress", o + 9);
+    } else if (strcmp(o, "numa") == 0) {
+      numa = true;
+    } else if (strncmp(o, "cpus=", 5) == 0) {
+      numa = true;
+      numa_cpus = o + 5;
+    } else if (strncmp(o, "service_cpu=", 12) == 0) {
+      numa = true;
+      service_cpu = atoi(o + 12);
+    } else if (strncmp(o, "gc_limit=", 9) == 0) {
+      gc_limit = (size_t)atoi(o + 9) << 20;
+    } else if (strcmp(o, "reclaimer") == 0) {
+      reclaimer = true;
+    } else {
+      fprintf(stderr, "Unknown extended option \"%s\"\n", o);
+      exit(2);
+    }
+  }
+}
+
 void parse_commandline(int argc, char **argv)
 {
   int ch;
-  while ((ch = getopt(argc, argv, "p:dm:c:vht:")) != -1) {
+  while ((ch = getopt(argc, argv, "p:dm:c:vht:f:n:Lo:")) != -1) {
     switch (ch) {
     case 'p':
       tcp_port = atoi(optarg);
@@ -69,6 +154,26 @@ void parse_commandline(int argc, char **argv)
     case 't':
       num_threads = atoi(optarg);
       break;
+    case 'f':
+      slab_factor = atof(optarg);
+      if (slab_factor <= 1.0) {
+        fprintf(stderr, "Factor must be greater than 1\n");
+        exit(2);
+      }
+      break;
+    case 'n':
+      slab_min_chunk = atoi(optarg);
+      if (slab_min_chunk <= 0) {
+        fprintf(stderr, "Chunk size must be greater than 0\n");
+        exit(2);
+      }
+      break;
+    case 'L':
+      large_pages = true;
+      break;
+    case 'o':
+      parse_extended(optarg);
+      break;
     case '?':
     default:
       fprintf(stderr, "Illegal argument \"%c\"\n", ch);
@@ -86,6 +191,31 @@ int main(int argc, char **argv)
     if (daemon(0, 0))
       err(1, NULL);
   }
+  if (numa) {
+    numa_enable(numa_cpus);
+    numa_set_service_cpu(service_cpu);
+  }
+  slab_init(slab_factor, slab_min_chunk);
+  // Items, keys and entries all live in the slab region, and some of
+  // it is lost to size class slack.
+  size_t region_mb = (size_t)(slab_region_bytes() * region_use) >> 20;
+  if ((size_t)max_memory_mb > region_mb) {
+    fprintf(stderr, "Memory limit of %d MB is more than the slab region "
+            "can hold, using %zu MB\n", max_memory_mb, region_mb);
+    max_memory_mb = region_mb;
+  }
+  if (large_pages)
+    slab_reserve((size_t)max_memory_mb * 1024 * 1024);
+  if (log_storage)
+    segment_enable();
+  if (dedup_min)
+    dedup_enable(dedup_min);
+  if (compress_min)
+    compress_enable(compress_min);
+  if (gc_limit)
+    gc_set_limit(gc_limit);
+  if (reclaimer)
+    gc_start_reclaimer();
   cache c((size_t)max_memory_mb * 1024 * 1024);
   io_service_pool io_pool(num_threads);
   service s(c, std::clog);
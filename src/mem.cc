@@ -2,7 +2,76 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #include "mem.h"
+#include "gc.h"
+#include "segment.h"
+#include "dedup.h"
+#include "compress.h"
+#include "counter.h"
+
+namespace {
+
+constexpr int nstripes = 64;
+
+// Pins are rare, so they are counted in a striped table rather than
+// in every mem; mem_flag_pinned says whether to look.
+struct pin
+{
+  size_t count = 0;
+  // Frees left to the last unpin. A shared mem can be freed once per
+  // reference while pinned.
+  size_t frees = 0;
+};
+
+struct pin_stripe
+{
+  std::mutex lock;
+  std::unordered_map<const mem *, pin> pins;
+};
+
+pin_stripe pin_stripes[nstripes];
+counter npinned;
+counter ndeferred;
+
+pin_stripe &
+stripe_of(const mem *m)
+{
+  return pin_stripes[((uintptr_t)m >> 4) % nstripes];
+}
+
+// Whether freeing m is left to mem_unpin(), marking it so if pinned.
+bool
+defer_free(mem *m)
+{
+  if (!(__atomic_load_n(&m->flags, __ATOMIC_ACQUIRE) & mem_flag_pinned))
+    return false;
+  pin_stripe &s = stripe_of(m);
+  std::lock_guard<std::mutex> l(s.lock);
+  auto i = s.pins.find(m);
+  if (i == s.pins.end())
+    return false;
+  i->second.frees++;
+  ++ndeferred;
+  return true;
+}
+
+// Holds a chain until the garbage collector can prove no reader
+// remains.
+class mem_garbage : public gc_object
+{
+  mem *m;
+public:
+  mem_garbage(mem *m) : gc_object(gc_kind_of<mem_garbage>()), m(m) { }
+  ~mem_garbage() { mem_free(m); }
+  size_t gc_size() const {
+    return slab_usable_size(this) + mem_footprint(m, nullptr);
+  }
+};
+
+}
 
 mem *
 mem_tail(mem *head)
@@ -25,8 +94,16 @@ mem_tail(const mem *head)
 mem *
 mem_alloc(size_t size)
 {
-  mem *b = static_cast<mem *>(malloc(sizeof(struct mem) + size));
+  size_t n = sizeof(struct mem) + size;
+  return mem_init(segment_enabled() ? segment_alloc(n) : slab_alloc(n), size);
+}
+
+mem *
+mem_init(void *p, size_t size)
+{
+  mem *b = static_cast<mem *>(p);
   b->magic = MEM_MAGIC;
+  b->flags = 0;
   b->next = nullptr;
   b->size = (uint32_t)size;
   return b;
@@ -37,8 +114,17 @@ mem_free_now(mem *m)
 {
   assert(m->magic == MEM_MAGIC);
   while (m) {
+    // A reader pinned the rest of the chain.
+    if (defer_free(m))
+      return;
     mem *next = m->next;
-    free(m);
+    if (mem_shared(m)) {
+      dedup_release(m);
+    } else {
+      if (mem_compressed(m))
+        compress_account(m, -1);
+      slab_free(m);
+    }
     m = next;
   }
 }
@@ -50,6 +136,54 @@ mem_free(mem *m)
   mem_free_now(m);
 }
 
+void
+mem_pin(const mem *m)
+{
+  __atomic_fetch_or(const_cast<uint16_t *>(&m->flags), mem_flag_pinned,
+                    __ATOMIC_RELEASE);
+  pin_stripe &s = stripe_of(m);
+  std::lock_guard<std::mutex> l(s.lock);
+  if (s.pins[m].count++ == 0)
+    ++npinned;
+}
+
+void
+mem_unpin(const mem *m)
+{
+  size_t frees;
+  {
+    pin_stripe &s = stripe_of(m);
+    std::lock_guard<std::mutex> l(s.lock);
+    auto i = s.pins.find(m);
+    assert(i != s.pins.end() && i->second.count > 0);
+    if (--i->second.count > 0)
+      return;
+    frees = i->second.frees;
+    s.pins.erase(i);
+    npinned.decr();
+  }
+  while (frees-- > 0)
+    mem_free_now(const_cast<mem *>(m));
+}
+
+size_t
+mem_pinned_count()
+{
+  return npinned;
+}
+
+size_t
+mem_deferred_frees()
+{
+  return ndeferred;
+}
+
+void
+mem_gc_free(mem *m)
+{
+  (new mem_garbage(m))->gc_free();
+}
+
 size_t
 mem_size(const mem *head, const mem *tail)
 {
@@ -57,3 +191,16 @@ mem_size(const mem *head, const mem *tail)
     return head ? head->size : 0;
   return head->size + mem_size(head->next, tail);
 }
+
+size_t
+mem_footprint(const mem *head, const mem *tail)
+{
+  size_t s = 0;
+  for (const mem *m = head; m; m = m->next) {
+    if (!mem_shared(m))
+      s += slab_usable_size(m);
+    if (m == tail)
+      break;
+  }
+  return s;
+}
@@ -1,21 +1,52 @@
-#define MEM_MAGIC (0xabcd1234)
+#define MEM_MAGIC (0x1234)
 
 #include <iostream>
 
 struct mem
 {
   typedef int32_t size_t;
-  uint32_t magic;
+  uint16_t magic;
+  uint16_t flags;
+  size_t size;                  // next to magic, for a 16 byte header
   mem *next;
-  size_t size;
   char data[0];
 };
 
+constexpr uint16_t mem_flag_shared = 1;     // see dedup.h
+constexpr uint16_t mem_flag_compressed = 2; // see compress.h
+constexpr uint16_t mem_flag_pinned = 4;     // see mem_pin(), never cleared
+
+// Whether m is a deduplicated value, which must not be modified.
+inline bool mem_shared(const mem *m) { return m->flags & mem_flag_shared; }
+// Whether m holds a whole value, compressed. Never part of a longer
+// chain.
+inline bool
+mem_compressed(const mem *m)
+{
+  return m->flags & mem_flag_compressed;
+}
+
 mem * mem_tail(mem *head);
 const mem * mem_tail(const mem *head);
 mem * mem_alloc(size_t size);
+// Set up a mem in memory the caller allocated.
+mem * mem_init(void *p, size_t size);
 void mem_free(mem *m);
+// Free a chain once no thread can be reading it.
+void mem_gc_free(mem *m);
+// Keep m and the chain after it from being freed until mem_unpin(),
+// for a reader still using the value once offline, such as an async
+// write. Pin while the chain is reachable, i.e. before checkpointing;
+// freeing a pinned mem leaves it to the last mem_unpin().
+void mem_pin(const mem *m);
+void mem_unpin(const mem *m);
+// Mems pinned now, and frees left to mem_unpin() since startup.
+size_t mem_pinned_count();
+size_t mem_deferred_frees();
 size_t mem_size(const mem *head, const mem *tail);
+// Memory allocated for head through tail, headers included. The whole
+// chain if tail is nullptr. Shared mems are not counted.
+size_t mem_footprint(const mem *head, const mem *tail);
 
 inline std::ostream&
 operator<<(std::ostream& o, const mem& m)
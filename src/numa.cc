@@ -0,0 +1,225 @@
+#include "numa.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <err.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "counter.h"
+
+namespace {
+
+constexpr int max_cpus = CPU_SETSIZE;
+
+bool enabled = false;
+int nnodes = 1;
+std::vector<int> node_cpus[numa_max_nodes];
+int cpu_node[max_cpus];
+std::vector<int> io_cpus;       // from -o cpus, in order
+int service_cpu = -1;
+thread_local int my_node = 0;
+
+counter local_reads;
+counter remote_reads;
+counter remote_frees;
+
+// Parse a sysfs style cpu list, like "0-3,8-11". Colons separate
+// too, as commas already separate -o options. Returns false if it is
+// malformed.
+bool
+parse_cpu_list(const char *s, std::vector<int> *cpus)
+{
+  while (*s && *s != '\n') {
+    char *end;
+    long lo = strtol(s, &end, 10), hi = lo;
+    if (end == s)
+      return false;
+    if (*end == '-') {
+      s = end + 1;
+      hi = strtol(s, &end, 10);
+      if (end == s)
+        return false;
+    }
+    if (lo < 0 || hi < lo || hi >= max_cpus)
+      return false;
+    for (long c = lo; c <= hi; ++c)
+      cpus->push_back(c);
+    s = end;
+    if (*s == ',' || *s == ':')
+      s++;
+    else if (*s && *s != '\n')
+      return false;
+  }
+  return true;
+}
+
+void
+read_topology()
+{
+  for (int n = 0; n < numa_max_nodes; ++n) {
+    char path[64], line[4096];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%d/cpulist", n);
+    FILE *f = fopen(path, "r");
+    if (f == nullptr)
+      break;
+    bool ok = fgets(line, sizeof(line), f) != nullptr &&
+      parse_cpu_list(line, &node_cpus[n]);
+    fclose(f);
+    if (!ok || node_cpus[n].empty()) {
+      node_cpus[n].clear();
+      break;
+    }
+    for (int c : node_cpus[n])
+      cpu_node[c] = n;
+    nnodes = n + 1;
+  }
+  if (nnodes == 1 && node_cpus[0].empty()) {
+    // No sysfs: one node with every cpu we may run on.
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int c = 0; c < max_cpus; ++c)
+        if (CPU_ISSET(c, &set))
+          node_cpus[0].push_back(c);
+    }
+    if (node_cpus[0].empty())
+      node_cpus[0].push_back(0);
+  }
+}
+
+void
+pin(const std::vector<int> &cpus, int node)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c : cpus)
+    CPU_SET(c, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    warn("sched_setaffinity");
+  my_node = node;
+}
+
+long
+mbind(void *p, size_t bytes, int mode, unsigned long nodes)
+{
+  return syscall(SYS_mbind, p, bytes, mode, &nodes, numa_max_nodes + 1, 0);
+}
+
+}
+
+void
+numa_enable(const char *cpus)
+{
+  read_topology();
+  if (cpus && !parse_cpu_list(cpus, &io_cpus)) {
+    fprintf(stderr, "Bad cpu list \"%s\"\n", cpus);
+    exit(2);
+  }
+  enabled = true;
+}
+
+void
+numa_set_service_cpu(int cpu)
+{
+  service_cpu = cpu;
+}
+
+bool
+numa_enabled()
+{
+  return enabled;
+}
+
+int
+numa_nodes()
+{
+  return nnodes;
+}
+
+int
+numa_node()
+{
+  return my_node;
+}
+
+void
+numa_bind_io_thread(int i)
+{
+  if (!enabled)
+    return;
+  if (!io_cpus.empty()) {
+    int cpu = io_cpus[i % io_cpus.size()];
+    return pin({ cpu }, cpu_node[cpu]);
+  }
+  // Round robin over nodes, then over each node's cores.
+  int node = i % nnodes;
+  const std::vector<int> &cpus = node_cpus[node];
+  pin({ cpus[(i / nnodes) % cpus.size()] }, node);
+}
+
+void
+numa_bind_service_thread()
+{
+  if (!enabled)
+    return;
+  if (service_cpu >= 0 && service_cpu < max_cpus)
+    pin({ service_cpu }, cpu_node[service_cpu]);
+  else
+    pin(node_cpus[0], 0);
+}
+
+void
+numa_prefer(void *p, size_t bytes, int node)
+{
+  if (enabled && nnodes > 1 &&
+      mbind(p, bytes, MPOL_PREFERRED, 1UL << node) != 0)
+    warn("mbind");
+}
+
+void
+numa_interleave(void *p, size_t bytes)
+{
+  if (enabled && nnodes > 1 &&
+      mbind(p, bytes, MPOL_INTERLEAVE, (1UL << nnodes) - 1) != 0)
+    warn("mbind");
+}
+
+void
+numa_count_read(int node)
+{
+  if (node == my_node)
+    local_reads.incr();
+  else
+    remote_reads.incr();
+}
+
+void
+numa_count_remote_free()
+{
+  remote_frees.incr();
+}
+
+size_t
+numa_local_reads()
+{
+  return local_reads;
+}
+
+size_t
+numa_remote_reads()
+{
+  return remote_reads;
+}
+
+size_t
+numa_remote_frees()
+{
+  return remote_frees;
+}
@@ -0,0 +1,43 @@
+/* -*-c++-*- */
+/* NUMA placement.
+ *
+ * When enabled, io threads and the service thread are pinned to
+ * cores, spread over the nodes or as listed with -o cpus, and the slab
+ * allocator keeps separate pages and free lists per node, so items
+ * are allocated on the node of the thread storing them. Big shared
+ * arrays, like the hash table's buckets, are interleaved. Without
+ * NUMA support, or with a single node, all of this is a no-op and
+ * everything is on node 0.
+ */
+#include <cstddef>
+
+constexpr int numa_max_nodes = 8;
+
+// Read the topology and turn placement on. cpus is a list like
+// "0-3:8", which io threads are pinned to in turn, or nullptr to
+// spread them over the nodes. Call before slab_init().
+void numa_enable(const char *cpus);
+void numa_set_service_cpu(int cpu);
+bool numa_enabled();
+int numa_nodes();
+// Node of the calling thread, 0 unless it was bound.
+int numa_node();
+
+// Pin the calling thread: the i'th io thread, or the service thread.
+void numa_bind_io_thread(int i);
+void numa_bind_service_thread();
+
+// Set the policy for untouched memory in [p, p + bytes).
+void numa_prefer(void *p, size_t bytes, int node);
+void numa_interleave(void *p, size_t bytes);
+
+// One in this many cache hits is counted.
+constexpr size_t numa_sample_mask = 63;
+
+// Sampled reads of items, by whether the item was on the reader's
+// node, and frees of chunks from another node.
+void numa_count_read(int node);
+void numa_count_remote_free();
+size_t numa_local_reads();
+size_t numa_remote_reads();
+size_t numa_remote_frees();
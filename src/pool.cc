@@ -11,32 +11,61 @@
 #include "pool.h"
 #include "cpu.h"
 #include "gc.h"
+#include "numa.h"
 #include <stdexcept>
 #include <thread>
-#include <boost/iterator/transform_iterator.hpp>
 
 namespace {
 
 // Check garbage collection every so many milliseconds
 const int gc_wakeup_ms = 500;
+// and every so many handlers, when busy.
+const int gc_handlers = 64;
 
 void
 thread_timer(boost::asio::deadline_timer *timer)
 {
   timer->expires_from_now(boost::posix_time::milliseconds(gc_wakeup_ms));
+  // run() parks the thread while it waits, and checkpointing a parked
+  // thread races with gc_relieve() handing its lists over.
+  gc_unpark();
   gc_lock();
   gc_unlock();
   timer->async_wait(std::bind(thread_timer, timer));
 }
 
+// Like io.run(), but checkpoint between handlers and park while
+// waiting for more (see gc.h).
+void
+run(boost::asio::io_service &io)
+{
+  int handlers = 0;
+  while (!io.stopped()) {
+    if (io.poll_one()) {
+      if (++handlers == gc_handlers) {
+        handlers = 0;
+        gc_checkpoint();
+      } else {
+        gc_relieve();
+      }
+    } else {
+      handlers = 0;
+      gc_park();
+      io.run_one();
+      gc_unpark();              // if the handler didn't
+    }
+  }
+}
+
 std::thread
-thread_constructor(boost::asio::io_service &io)
+thread_constructor(boost::asio::io_service &io, size_t index)
 {
-  return std::thread([&]() {
+  return std::thread([&io, index]() {
+      numa_bind_io_thread(index);
       cpu_init();
       boost::asio::deadline_timer timer(io);
       thread_timer(&timer);
-      io.run();
+      run(io);
       cpu_exit();
       timer.cancel();           // XXX - racey?
     });
@@ -44,8 +73,6 @@ thread_constructor(boost::asio::io_service &io)
 
 }
 
-using boost::make_transform_iterator;
-
 io_service_pool::io_service_pool(size_t pool_size)
   : io_services_(pool_size),
     work_(io_services_.begin(), io_services_.end()),
@@ -53,9 +80,9 @@ io_service_pool::io_service_pool(size_t pool_size)
 
 void io_service_pool::run()
 {
-  std::vector<std::thread>
-    threads(make_transform_iterator(io_services_.begin(), thread_constructor),
-            make_transform_iterator(io_services_.end(), thread_constructor));
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < io_services_.size(); ++i)
+    threads.push_back(thread_constructor(io_services_[i], i));
 
   for (std::thread &t : threads)
     t.join();
@@ -7,6 +7,12 @@ public:
   rope(mem *head, mem *tail) : head_(head), tail_(tail) { }
   rope() : rope(nullptr, nullptr) { }
   size_t size() const { return mem_size(head_, tail_); }
+  uint32_t segments() const {
+    uint32_t n = 1;
+    for (const mem *m = head_; m != tail_; m = m->next)
+      ++n;
+    return n;
+  }
 
   mem *head() const { return head_; }
   mem *tail() const { return tail_; }
@@ -0,0 +1,217 @@
+#include "slab.h"
+#include "segment.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+namespace {
+
+// Segments less full than this are cleaned, at most max_clean per
+// segment_select() so one collect doesn't copy the world.
+constexpr double clean_ratio = 0.5;
+constexpr int max_clean = 16;
+// An open segment holds this much extra on its live count, so it
+// can't be released while still being filled.
+constexpr size_t open_bias = 1;
+
+struct segment
+{
+  std::atomic<size_t> live;     // live bytes, plus open_bias if open
+  std::atomic<segment_state> state;
+  segment *prev;                // sealed segments, oldest first
+  segment *next;
+  size_t used;                  // filling thread only
+};
+
+struct object_header
+{
+  uint32_t size;                // allocated, header included
+  uint32_t unused;
+};
+
+constexpr size_t data_offset = (sizeof(segment) + 15) & ~15;
+
+void segment_free(void *p);
+size_t segment_usable_size(const void *p);
+const slab_page_owner owner = { segment_free, segment_usable_size };
+
+struct open_segment
+{
+  segment *seg = nullptr;
+  ~open_segment();
+};
+
+std::atomic<bool> enabled(false);
+thread_local open_segment current;
+
+std::mutex list_lock;
+segment *oldest = nullptr;
+segment *newest = nullptr;
+std::atomic<size_t> nsegments(0);
+std::atomic<size_t> nreleased(0);
+
+segment *
+segment_of(const void *p)
+{
+  return static_cast<segment *>(slab_page_data(p));
+}
+
+segment *
+segment_new()
+{
+  segment *s = new (slab_page_alloc(&owner)) segment();
+  s->live = open_bias;
+  s->state = segment_state::open;
+  s->prev = s->next = nullptr;
+  s->used = data_offset;
+  nsegments++;
+  return s;
+}
+
+void
+segment_release(segment *s)
+{
+  {
+    std::lock_guard<std::mutex> l(list_lock);
+    if (s->prev)
+      s->prev->next = s->next;
+    else
+      oldest = s->next;
+    if (s->next)
+      s->next->prev = s->prev;
+    else
+      newest = s->prev;
+  }
+  nsegments--;
+  nreleased++;
+  s->~segment();
+  slab_page_release(s);
+}
+
+void
+segment_unref(segment *s, size_t bytes)
+{
+  if (s->live.fetch_sub(bytes) == bytes)
+    segment_release(s);
+}
+
+void
+segment_seal(segment *s)
+{
+  {
+    std::lock_guard<std::mutex> l(list_lock);
+    s->prev = newest;
+    if (newest)
+      newest->next = s;
+    else
+      oldest = s;
+    newest = s;
+    s->state = segment_state::sealed;
+  }
+  segment_unref(s, open_bias);
+}
+
+void
+segment_free(void *p)
+{
+  object_header *h = static_cast<object_header *>(p) - 1;
+  segment_unref(segment_of(p), h->size);
+}
+
+size_t
+segment_usable_size(const void *p)
+{
+  return (static_cast<const object_header *>(p) - 1)->size;
+}
+
+open_segment::~open_segment()
+{
+  if (seg)
+    segment_seal(seg);
+}
+
+}
+
+void
+segment_enable()
+{
+  enabled = true;
+}
+
+bool
+segment_enabled()
+{
+  return enabled.load(std::memory_order_relaxed);
+}
+
+void *
+segment_alloc(size_t size)
+{
+  size_t need = (sizeof(object_header) + size + 7) & ~7;
+  if (need > slab_page_data_size - data_offset)
+    return slab_alloc(size);
+
+  segment *s = current.seg;
+  if (s == nullptr || s->used + need > slab_page_data_size) {
+    if (s) {
+      current.seg = nullptr;
+      segment_seal(s);
+    }
+    s = current.seg = segment_new();
+  }
+  object_header *h = (object_header *)((char *)s + s->used);
+  s->used += need;
+  s->live += need;
+  h->size = need;
+  return h + 1;
+}
+
+segment_state
+segment_state_of(const void *p)
+{
+  if (slab_page_owner_of(p) != &owner)
+    return segment_state::none;
+  return segment_of(p)->state;
+}
+
+void
+segment_select(size_t evict_bytes)
+{
+  const size_t clean_below = slab_page_data_size * clean_ratio;
+  int cleaning = 0;
+  std::lock_guard<std::mutex> l(list_lock);
+  for (segment *s = oldest; s; s = s->next) {
+    segment_state state = s->state;
+    size_t live = s->live;
+    if (state == segment_state::evicting) {
+      evict_bytes -= std::min(evict_bytes, live);
+    } else if (evict_bytes > 0) {
+      s->state = segment_state::evicting;
+      evict_bytes -= std::min(evict_bytes, live);
+    } else if (state == segment_state::cleaning) {
+      cleaning++;
+    } else if (live < clean_below && cleaning < max_clean) {
+      s->state = segment_state::cleaning;
+      cleaning++;
+    }
+  }
+}
+
+segment_stats
+segment_get_stats()
+{
+  segment_stats st = { nsegments, 0, 0, 0, nreleased };
+  std::lock_guard<std::mutex> l(list_lock);
+  for (segment *s = oldest; s; s = s->next) {
+    st.live_bytes += s->live;
+    if (s->state == segment_state::cleaning)
+      st.cleaning++;
+    else if (s->state == segment_state::evicting)
+      st.evicting++;
+  }
+  return st;
+}
@@ -0,0 +1,48 @@
+/* -*-c++-*- */
+/* Log structured value storage.
+ *
+ * When enabled, mem_alloc() appends values to large fixed size
+ * segments (slab pages) instead of size classes. Each thread fills
+ * its own open segment; once full it is sealed and queued, oldest
+ * first. A segment only counts its live bytes and is released as a
+ * whole when they drop to zero, so there is no fragmentation inside
+ * it.
+ *
+ * The cache's collect() does the cleaning. segment_select() marks
+ * sparse segments for cleaning, whose live values collect() copies
+ * elsewhere, and the oldest segments for eviction, whose values it
+ * drops, FIFO style.
+ */
+#include <cstddef>
+
+enum class segment_state
+{
+  none,                         // not in a segment
+  open,                         // being filled
+  sealed,
+  cleaning,                     // live values should be moved
+  evicting,                     // live values should be dropped
+};
+
+void segment_enable();
+bool segment_enabled();
+
+// Allocate from this thread's open segment. Large requests go to the
+// slab allocator instead. Free with slab_free().
+void *segment_alloc(size_t size);
+
+segment_state segment_state_of(const void *p);
+
+// Mark sealed segments for cleaning, and the oldest for eviction
+// until roughly evict_bytes of live data is covered.
+void segment_select(size_t evict_bytes);
+
+struct segment_stats
+{
+  size_t segments;              // open or sealed
+  size_t live_bytes;
+  size_t cleaning;
+  size_t evicting;
+  size_t released;              // segments emptied since startup
+};
+segment_stats segment_get_stats();
@@ -3,49 +3,90 @@
 #include "service.h"
 #include <cassert>
 #include "log.h"
+#include "numa.h"
 
-auto service::next() -> time_type
+void service::step()
 {
-  time_type tt;
-  int res = clock_gettime(clock, &tt);
-  assert(res == 0);             // XXX
-  tt.tv_sec += service_period_sec;
-  return tt;
+  gc_lock();
+  bool more = c.collect_step();
+  gc_unlock();
+  if (more) {
+    gc_flush_async([this]() {
+        std::lock_guard<std::mutex> l(lock);
+        step_ready = true;
+        wakeup.notify_one();
+      });
+  } else {
+    collecting = false;
+    log << INFO << "collect complete" << std::endl;
+  }
 }
 
-void service::run()
+// Work which doesn't have to wait for the collector.
+void service::maintain()
 {
-  gc_lock();
-  log << INFO << "starting collect" << std::endl;
-  c.collect();
-  log << INFO << "collect complete" << std::endl;
-  gc_unlock();
+  size_t returned = slab_release_free();
+  if (returned)
+    log << INFO << "returned " << returned << " bytes" << std::endl;
 }
 
 void service::loop()
 {
+  clock::time_point due = clock::now();
   while (running) {
-    time_type nxt = next();
-    run();
-    clock_nanosleep(clock, TIMER_ABSTIME, &nxt, NULL);
+    bool ready;
+    {
+      std::lock_guard<std::mutex> l(lock);
+      ready = step_ready;
+      step_ready = false;
+    }
+    if (ready) {
+      step();
+    } else if (!collecting && clock::now() >= due) {
+      due += std::chrono::seconds(service_period_sec);
+      log << INFO << "starting collect" << std::endl;
+      collecting = true;
+      step();
+      maintain();
+    }
+    gc_park();
+    {
+      std::unique_lock<std::mutex> l(lock);
+      wakeup.wait_until(l, due, [this]() { return step_ready || !running; });
+    }
+    gc_unpark();
+  }
+  // Let a collect in progress finish.
+  while (collecting) {
+    gc_flush();
+    std::unique_lock<std::mutex> l(lock);
+    wakeup.wait(l, [this]() { return step_ready; });
+    step_ready = false;
+    l.unlock();
+    step();
   }
 }
 
 void service::entry()
 {
+  numa_bind_service_thread();
   cpu_init();
   loop();
   cpu_exit();
 }
 
 service::service(cache &c, std::ostream &log)
-  : c(c), log(log), running(true), worker(std::bind(&service::entry, this))
+  : c(c), log(log), running(true), collecting(false), step_ready(false),
+    worker(std::bind(&service::entry, this))
 {
 }
 
 service::~service()
 {
-  // XXX - lame
-  running = false;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    running = false;
+    wakeup.notify_one();
+  }
   worker.join();
 }
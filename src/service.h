@@ -1,4 +1,6 @@
-#include <time.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 
 class service
@@ -7,13 +9,18 @@ private:
   cache &c;
   std::ostream &log;
   std::atomic<bool> running;
+  // A collect runs in stages, the next one once gc_flush_async()
+  // calls back; the thread is free for other work in between.
+  bool collecting;
+  bool step_ready;              // guarded by lock
+  std::mutex lock;
+  std::condition_variable wakeup;
   std::thread worker;
-  static const clockid_t clock = CLOCK_MONOTONIC;
+  typedef std::chrono::steady_clock clock;
   static const int service_period_sec = 5;
-  typedef struct timespec time_type;
-  static time_type next();
   void loop();
-  void run();
+  void step();
+  void maintain();
   void entry();
 public:
   service(cache &c, std::ostream &log);
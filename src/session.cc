@@ -3,19 +3,36 @@
 #include "session.h"
 #include "utils.h"
 #include "log.h"
+#include "numa.h"
+#include "dedup.h"
+#include "compress.h"
 
 #include "config.h"
 
 #include <cassert>
 #include <cstdarg>
 #include <cstring>
+#include <new>
+#include <string>
 
 #include <boost/asio.hpp>
 
 // XXX - the entire commanline must fit here
 constexpr int buffer_size = 4096;
-// must be less than buffer_size
-constexpr int max_key_size = 255;
+// as memcached; must be less than buffer_size
+constexpr int max_key_size = 250;
+// Values up to this size are copied into the output buffer, larger
+// ones sent from where they are.
+constexpr size_t copy_max = 1024;
+// Keys looked up together by get, and the most a VALUE line takes
+// besides the key.
+constexpr int get_batch = 16;
+constexpr int value_line_max = 64;
+// Responses to pipelined commands are collected until the input runs
+// out, or until there's less room than this left in the output buffer
+// or this many value bytes are waiting to be sent.
+constexpr int pipeline_room = 1024;
+constexpr size_t pipeline_ref_max = 1 << 20;
 
 using namespace std;
 
@@ -33,7 +50,10 @@ using namespace std;
  *                               |                           v
  *                               +--------------------- write_data
  *
- * IO errors cause the session to stop.
+ * write_result only flushes when the output is nearly full; otherwise
+ * read_command flushes once no complete command is left in the input.
+ * IO errors cause the session to stop. A value which can't be stored
+ * for lack of memory is skipped (skip_data) before write_result.
  */
 
 enum session_state {
@@ -41,7 +61,8 @@ enum session_state {
   session_read_command,                 // Reading the next command
   session_execute_command,              // Execute the command or reading set data
   session_execute_write,                // Execute the set/add/etc. command
-  session_write_data,
+  session_write_data,                   // Sending a full buffer mid-command
+  session_skip_data,                    // Discarding set data
   session_write_result,
   session_stopping,
 };
@@ -55,6 +76,7 @@ operator<<(ostream &o, session_state s)
   case session_execute_command: return o << "execute_command";
   case session_execute_write:   return o << "execute_write";
   case session_write_data:      return o << "write_data";
+  case session_skip_data:       return o << "skip_data";
   case session_write_result:    return o << "write_result";
   case session_stopping:        return o << "stopping";
   }
@@ -64,7 +86,7 @@ operator<<(ostream &o, session_state s)
 class server_error_t {};
 class client_error_t {};
 
-class text_session : public session
+class text_session : public session, private stats_sink
 {
   // session lifetime state
   boost::asio::io_service &io_service; // ASIO handle
@@ -84,12 +106,32 @@ class text_session : public session
     [this](boost::system::error_code ec, size_t bytes) -> size_t {
     return cmd_callback(ec, bytes);
   };
+  function<void (boost::system::error_code, size_t)> cmd_done_ =
+    [this](boost::system::error_code ec, size_t bytes) -> void {
+    cmd_done(ec, bytes);
+  };
+  function<void (boost::system::error_code, size_t)> write_done_ =
+    [this](boost::system::error_code ec, size_t bytes) -> void {
+    write_done(ec, bytes);
+  };
+  function<void (boost::system::error_code, size_t)> skip_done_ =
+    [this](boost::system::error_code ec, size_t bytes) -> void {
+    skip_done(ec, bytes);
+  };
 
   buffer ibuf;               // Input buffer (current command)
   buffer obuf;               // Staged output for the current command
+  // What flush() writes, with one gathered write: fragments of obuf,
+  // and values sent from the cache, pinned until it completes.
+  std::vector<boost::asio::const_buffer> iov_;
+  int ofrag_ = 0;            // start of obuf's fragment not in iov_
+  size_t oref_bytes_ = 0;    // value bytes in iov_
+  std::vector<const mem *> pins_;
+  std::string ostats_;       // stat responses, sent by reference
 
   // Current command state
   bool noreply_;             // When true, replys are suppressed
+  bool cmd_found_;           // cmd_ready() has seen the whole command
   session_state state_;
   buf args_;
   buf cmd_;
@@ -97,35 +139,41 @@ class text_session : public session
   uint64_t unique_;
   buf key_;
   mem *idata_ = NULL;
-  const_rope odata_;
+  size_t skip_;              // set data left to discard
 
   // Input
   bool recv_command();
   bool recv_data(size_t bytes);
+  bool skip_data();
 
   // Output
   bool send_prompt();
-  void send_async(const char *msg, size_t bytes);
+  void send_ref(buf b);
   void send_n(const char *msg, size_t bytes);
   void send(const char *msg);
   void sendln(const char *msg);
   void sendf(const char *fmt, ...);
   void vsendf(const char *fmt, va_list ap);
-  void send_stat(const char *name, const char *val);
-  void send_stat(const char *name, uint64_t val);
+  using stats_sink::stat;
+  void stat(const char *name, const char *val) override;
   void send_cache_result(cache_error_t res);
   void client_error(const char *fmt, ...);
   void server_error(const char *fmt, ...);
-  bool send_data();
+  void end_fragment();
+  void reset_output();
+  void release_data();
   bool flush();
+  bool output_full() const;
 
   // Command handlers
   bool flush_all();
   bool cas();
   bool get(bool cas_unique);
+  void send_value(buf key, cache::ref e, bool cas_unique, int &spare);
   bool incr_decr(bool incr);
   bool del();
   bool stats();
+  bool stats_slabs();
   bool version();
   bool touch();
 
@@ -139,6 +187,9 @@ class text_session : public session
   // text_session helpers
   void callback(boost::system::error_code ec, size_t bytes);
   size_t cmd_callback(boost::system::error_code ec, size_t bytes);
+  void write_done(boost::system::error_code ec, size_t bytes);
+  void cmd_done(boost::system::error_code ec, size_t bytes);
+  void skip_done(boost::system::error_code ec, size_t bytes);
   bool cmd_ready(size_t additional);
   void loop();
 
@@ -151,7 +202,7 @@ public:
           ostream &log, const char *prompt)
     : io_service(io_service), money(c), in(in), out(out), log(log),
       prompt_(prompt), ibuf(buffer_size), obuf(buffer_size) { }
-  ~text_session() { }
+  ~text_session() { release_data(); }
   void interact(session_done done);
 };
 
@@ -180,23 +231,48 @@ text_session::parse_noreply()
 {
   buf nr = consume_token(args_);
   if (!nr.empty()) {
-    if (nr.is("noreplay"))
+    if (nr.is("noreply"))
       noreply_ = true;
     else
       client_error("expected noreply or end of command");
   }
 }
 
+// Output since the last fragment is the next one.
+void
+text_session::end_fragment()
+{
+  if (obuf.used() > ofrag_) {
+    iov_.emplace_back(obuf.headp() + ofrag_, obuf.used() - ofrag_);
+    ofrag_ = obuf.used();
+  }
+}
+
+void
+text_session::reset_output()
+{
+  obuf.reset();
+  ofrag_ = 0;
+  oref_bytes_ = 0;
+  ostats_.clear();
+}
+
+bool
+text_session::output_full() const
+{
+  return obuf.available() < pipeline_room ||
+    oref_bytes_ >= pipeline_ref_max || !ostats_.empty();
+}
+
+// Asio splits a long list into several writev() calls.
 bool
 text_session::flush()
 {
-  if (obuf.empty()) {
+  end_fragment();
+  if (iov_.empty())
     return false;
-  } else {
-    out.async_write(boost::asio::const_buffers_1(obuf.headp(), obuf.used()),
-                    callback_);
-    return true;
-  }
+  out.async_write(iov_, write_done_);
+  return true;
 }
 
 void
@@ -206,12 +282,15 @@ text_session::send_n(const char *msg, size_t bytes)
     obuf.write(msg, bytes);
 }
 
+// Send b from where it is. It must stay put until the write is done.
 void
-text_session::send_async(const char *msg, size_t bytes)
+text_session::send_ref(buf b)
 {
-  assert(obuf.used() == 0);     // XXX - we could flush now
-  // XXX - we could take a rope...
-  out.async_write(boost::asio::const_buffers_1(msg, bytes), callback_);
+  if (!noreply_) {
+    end_fragment();
+    iov_.emplace_back(b.headp(), b.size());
+    oref_bytes_ += b.size();
+  }
 }
 
 void
@@ -234,70 +313,107 @@ text_session::sendf(const char *fmt, ...)
 }
 
 void
-text_session::send_stat(const char *name, const char *val)
+text_session::stat(const char *name, const char *val)
 {
-  sendf("STAT %s %s", name, val);
+  ostats_.append("STAT ");
+  ostats_.append(name);
+  ostats_.append(" ");
+  ostats_.append(val);
+  ostats_.append(CRLF);
 }
 
 void
-text_session::send_stat(const char *name, uint64_t val)
+text_session::release_data()
 {
-  char buf[64];
-  snprintf(buf, sizeof(buf), "%lu", val);
-  send_stat(name, buf);
+  for (const mem *m : pins_)
+    mem_unpin(m);
+  pins_.clear();
 }
 
-bool
-text_session::send_data()
-{
-  const mem *m = odata_.pop();
-  if (!m) {
-    send(CRLF);
-    set_state(session_execute_command);
-    return false;
-  } else {
-    set_state(session_write_data);
-    send_async(m->data, m->size);
-    return true;
-  }
-}
-
-bool
-text_session::get(bool cas_unique)
-{
-  buf key = consume_token(args_);
-  if (key.empty()) {
-    send("END" CRLF);
-    set_state(session_write_result);
-    return false;
-  }
-
-  cache::ref e = money.get(key);
-  if (e == nullptr) {
-    sendln("NOT_FOUND");
-    set_state(session_write_result);    // XXX - what about multiple results?
-    return false;
-  }
-
-  odata_ = e->read();
-  size_t size = odata_.size();
+// Sends nothing, as for a miss, if the value can't be read. get()
+// reserved room for the VALUE line and an inline value; copying a
+// larger value takes what more it needs from spare.
+void
+text_session::send_value(buf key, cache::ref e, bool cas_unique, int &spare)
+{
+  // Read the version before the data: if a write races with us the
+  // client gets a stale unique and a later cas fails conservatively.
+  uint64_t version = e->get_version();
+  const_rope data;
+  if (!e->read(&data))
+    return;
+  size_t size = data.size();
   if (cas_unique) {
-    uint64_t version = odata_.hash(e->get_flags());
     sendf("VALUE %.*s %u %u %llu",
           key.used(), key.headp(), e->get_flags(), size, version);
   } else {
     sendf("VALUE %.*s %u %u",
           key.used(), key.headp(), e->get_flags(), size);
   }
-  int margin = max_key_size + 64; // enough to send the next VALUE line
-  if (obuf.available() > size + margin) {
-    while (const mem *m = odata_.pop())
-      send_n(m->data, m->size);
-    send(CRLF);
-    return false;
+  int extra = max((int)size - (int)entry::inline_max, 0);
+  if (size <= copy_max && extra <= spare) {
+    spare -= extra;
+    while (!data.empty()) {
+      buf b = data.pop();
+      send_n(b.headp(), b.size());
+    }
+  } else if (const mem *m = data.head()) {
+    // The thread may checkpoint before the write is done.
+    mem_pin(m);
+    pins_.push_back(m);
+    while (!data.empty())
+      send_ref(data.pop());
   } else {
-    set_state(session_write_data);
-    return flush();
+    // Inline, which get() left room for.
+    buf b = data.pop();
+    send_n(b.headp(), b.size());
+  }
+  send(CRLF);
+}
+
+// Keys are looked up get_batch at a time, and misses skipped. When
+// the output buffer can't hold the next key's VALUE line and a value
+// inline in its entry, it's flushed and we carry on from that key.
+bool
+text_session::get(bool cas_unique)
+{
+  while (true) {
+    buf keys[get_batch];
+    cache::ref refs[get_batch];
+    buf rest = args_;
+    int room = obuf.available() - (int)sizeof("END" CRLF);
+    int n = 0;
+    while (n < get_batch) {
+      buf save = rest;
+      buf k = consume_token(rest);
+      if (k.size() > max_key_size)
+        client_error("key too long");
+      int need = k.size() + value_line_max + entry::inline_max;
+      if (k.empty() || need > room) {
+        rest = save;
+        break;
+      }
+      room -= need;
+      keys[n++] = k;
+    }
+    if (n == 0) {
+      if (!consume_token(rest).empty()) {
+        // An empty buffer has room for any key.
+        if (!flush())
+          server_error("no room for key");
+        set_state(session_write_data);
+        return true;
+      }
+      send("END" CRLF);
+      set_state(session_write_result);
+      return false;
+    }
+    args_ = rest;
+    money.get_many(keys, n, refs);
+    for (int i = 0; i < n; ++i) {
+      if (refs[i])
+        send_value(keys[i], refs[i], cas_unique, room);
+    }
   }
 }
 
@@ -333,6 +449,8 @@ text_session::parse_key()
   key_ = consume_token(args_);
   if (key_.empty())
     client_error("missing key");
+  else if (key_.size() > max_key_size)
+    client_error("key too long");
 }
 
 void
@@ -377,6 +495,9 @@ text_session::send_cache_result(cache_error_t res)
   case cache_error_t::cas_exists:
     sendln("EXISTS");
     break;
+  case cache_error_t::not_numeric:
+    sendln("CLIENT_ERROR cannot increment or decrement non-numeric value");
+    break;
   }
   set_state(session_write_result);
 }
@@ -399,6 +520,7 @@ text_session::incr_decr(bool incr)
 
   if (res == cache_error_t::stored) {
     sendf("%llu", v);
+    set_state(session_write_result);
   } else {
     send_cache_result(res);
   }
@@ -449,21 +571,132 @@ text_session::version()
   return false;
 }
 
+void
+stats_sink::stat(const char *name, uint64_t val)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%lu", val);
+  stat(name, buf);
+}
+
+void
+report_stats(cache &c, stats_sink &s)
+{
+  s.stat("version", PACKAGE_VERSION);
+  s.stat("pointer_size", sizeof(void*));
+  s.stat("cmd_get", c.get_count());
+  s.stat("cmd_set", c.set_count());
+  s.stat("cmd_flush", c.flush_count());
+  s.stat("cmd_touch", c.touch_count());
+  s.stat("get_hits", c.get_hit_count());
+  s.stat("get_misses", c.get_miss_count());
+  s.stat("bytes", c.bytes());
+  s.stat("key_bytes", c.key_bytes());
+  s.stat("overhead_bytes", c.overhead_bytes());
+  s.stat("item_bytes", c.item_bytes());
+  s.stat("table_bytes", c.table_bytes());
+  s.stat("gc_pending_objects", gc_pending_objects());
+  s.stat("gc_pending_bytes", gc_pending_bytes());
+  s.stat("gc_oldest_pending_ms", gc_oldest_pending_ms());
+  s.stat("gc_forced_checkpoints", gc_forced_checkpoints());
+  s.stat("gc_epoch", gc_epoch());
+  s.stat("pinned_values", mem_pinned_count());
+  s.stat("pinned_deferred_frees", mem_deferred_frees());
+  s.stat("gc_destroyed_objects", gc_destroyed_objects());
+  s.stat("gc_destroyed_bytes", gc_destroyed_bytes());
+  if (gc_reclaimer_enabled()) {
+    s.stat("gc_reclaim_queue_objects", gc_reclaim_queue_objects());
+    s.stat("gc_reclaim_queue_bytes", gc_reclaim_queue_bytes());
+  }
+  s.stat("limit_maxbytes", c.max_item_bytes());
+  s.stat("buckets", c.buckets());
+  s.stat("keys", c.keys());
+  s.stat("coalesced", c.coalesce_count());
+  if (segment_enabled()) {
+    segment_stats st = segment_get_stats();
+    s.stat("log_segments", st.segments);
+    s.stat("log_live_bytes", st.live_bytes);
+    s.stat("log_cleaning", st.cleaning);
+    s.stat("log_evicting", st.evicting);
+    s.stat("log_released", st.released);
+    s.stat("log_relocated", c.relocation_count());
+    s.stat("log_evicted", c.log_eviction_count());
+  }
+  if (dedup_enabled()) {
+    dedup_stats st = dedup_get_stats();
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.2f",
+             st.bytes ? (double)st.logical_bytes / st.bytes : 1.0);
+    s.stat("dedup_values", st.values);
+    s.stat("dedup_refs", st.refs);
+    s.stat("dedup_bytes", st.bytes);
+    s.stat("dedup_logical_bytes", st.logical_bytes);
+    s.stat("dedup_ratio", ratio);
+  }
+  if (compress_enabled()) {
+    compress_stats st = compress_get_stats();
+    s.stat("compress_values", st.values);
+    s.stat("compress_raw_bytes", st.raw_bytes);
+    s.stat("compress_stored_bytes", st.stored_bytes);
+    s.stat("compress_saved_bytes", st.raw_bytes - st.stored_bytes);
+    s.stat("compress_count", st.compressed);
+    s.stat("compress_rejected", st.rejected);
+    s.stat("compress_usec", st.compress_usec);
+    s.stat("decompress_count", st.decompressed);
+    s.stat("decompress_usec", st.decompress_usec);
+    s.stat("decompress_failed", st.failed);
+  }
+  if (numa_enabled()) {
+    s.stat("numa_nodes", numa_nodes());
+    s.stat("numa_local_reads", numa_local_reads());
+    s.stat("numa_remote_reads", numa_remote_reads());
+    s.stat("numa_remote_frees", numa_remote_frees());
+  }
+}
+
+void
+report_slab_stats(stats_sink &s)
+{
+  std::vector<slab_class_stats> classes = slab_stats();
+  for (const slab_class_stats &c : classes) {
+    auto class_stat = [&](const char *what, uint64_t val) {
+      char name[64];
+      snprintf(name, sizeof(name), "%d:%s", c.id, what);
+      s.stat(name, val);
+    };
+    class_stat("chunk_size", c.chunk_size);
+    class_stat("chunks_per_page", c.chunks_per_page);
+    class_stat("total_pages", c.total_pages);
+    class_stat("total_chunks", c.total_pages * c.chunks_per_page);
+    class_stat("used_chunks", c.used_chunks);
+    class_stat("free_chunks", c.free_chunks);
+  }
+  s.stat("active_slabs", classes.size());
+  s.stat("total_malloced", slab_total_malloced());
+  s.stat("arena_bytes", slab_arena_bytes());
+  s.stat("arena_huge_bytes", slab_arena_huge_bytes());
+  s.stat("returned_bytes", slab_returned_bytes());
+}
+
+bool
+text_session::stats_slabs()
+{
+  report_slab_stats(*this);
+  ostats_.append("END" CRLF);
+  send_ref(buf(ostats_.data(), ostats_.size()));
+  set_state(session_write_result);
+  return false;
+}
+
 bool
 text_session::stats()
 {
-  send_stat("version", PACKAGE_VERSION);
-  send_stat("pointer_size", sizeof(void*));
-  send_stat("cmd_get", money.get_count());
-  send_stat("cmd_set", money.set_count());
-  send_stat("cmd_flush", money.flush_count());
-  send_stat("cmd_touch", money.touch_count());
-  send_stat("get_hits", money.get_hit_count());
-  send_stat("get_misses", money.get_miss_count());
-  send_stat("bytes", money.bytes());
-  send_stat("buckets", money.buckets());
-  send_stat("keys", money.keys());
-  send("END" CRLF);
+  buf what = consume_token(args_);
+  if (what.is("slabs"))
+    return stats_slabs();
+  report_stats(money, *this);
+  ostats_.append("END" CRLF);
+  send_ref(buf(ostats_.data(), ostats_.size()));
   set_state(session_write_result);
   return false;
 }
@@ -525,8 +758,18 @@ text_session::dispatch()
   } else if (cmd_.is("version")) {
     return version();
   } else if (cmd_.is("stats")) {
+    // The responses go in ostats_, which can't move until they're
+    // sent, so anything before them is sent first.
+    if (flush()) {
+      set_state(session_write_data);
+      return true;
+    }
     return stats();
   } else if (cmd_.is("quit")) {
+    if (flush()) {
+      set_state(session_write_data);
+      return true;
+    }
     set_state(session_stopping);
     return false;
   } else {
@@ -540,7 +783,13 @@ text_session::dispatch()
 bool
 text_session::recv_data(size_t bytes)
 {
-  idata_ = mem_alloc(bytes);       // XXX - memory chunk size
+  try {
+    idata_ = mem_alloc(bytes);     // XXX - memory chunk size
+  } catch (std::bad_alloc &) {
+    skip_ = bytes;
+    set_state(session_skip_data);
+    return false;
+  }
   size_t ready = min(bytes, (size_t)ibuf.used());
   memcpy(idata_->data, ibuf.headp(), ready);
   ibuf.notify_read(ready);
@@ -548,13 +797,34 @@ text_session::recv_data(size_t bytes)
   if (ready == bytes) {
     return false;
   } else {
-    in.async_read(boost::asio::mutable_buffers_1(idata_->data, bytes),
+    in.async_read(boost::asio::mutable_buffers_1(idata_->data + ready,
+                                                 bytes - ready),
                   boost::asio::transfer_exactly(bytes - ready),
                   callback_);
     return true;
   }
 }
 
+// Read past the value of a command we're out of memory for, to the
+// next command.
+bool
+text_session::skip_data()
+{
+  size_t n = min(skip_, (size_t)ibuf.used());
+  ibuf.notify_read(n);
+  skip_ -= n;
+  if (skip_ == 0) {
+    sendln("SERVER_ERROR out of memory storing object");
+    set_state(session_write_result);
+    return false;
+  }
+  ibuf.reset();
+  size_t want = min(skip_, (size_t)ibuf.available());
+  in.async_read(boost::asio::mutable_buffers_1(ibuf.tailp(), want),
+                boost::asio::transfer_exactly(want), skip_done_);
+  return true;
+}
+
 bool
 text_session::send_prompt()
 {
@@ -571,13 +841,18 @@ bool
 text_session::recv_command()
 {
   noreply_ = false;
+  cmd_found_ = false;
   set_state(session_execute_command);
   if (cmd_ready(0)) {
     return false;
+  } else if (flush()) {
+    // Answer the pipelined commands before waiting for more.
+    set_state(session_read_command);
+    return true;
   } else {
     ibuf.compact();
     in.async_read(boost::asio::mutable_buffers_1(ibuf.tailp(), ibuf.available()),
-                  cmd_callback_, callback_);
+                  cmd_callback_, cmd_done_);
     return true;
   }
 }
@@ -591,9 +866,11 @@ text_session::cmd_ready(size_t additional)
     args_ = ibuf.sub(end - ibuf.headp());
     cmd_ = consume_token(args_);
     log << INFO << "cmd> " << cmd_ << args_ << std::endl;
+    cmd_found_ = true;
     return true;
   } else if (additional == ibuf.available()) {
     // We can't buffer the command, so hang up the phone.
+    cmd_found_ = true;
     state_ = session_stopping;
     log << INFO << "command overflow" << std::endl;
     return true;
@@ -610,6 +887,33 @@ text_session::cmd_callback(boost::system::error_code ec, size_t bytes)
     return cmd_ready(bytes) ? 0 : ibuf.available() - bytes;
 }
 
+// The completion condition isn't asked again once the read fills the
+// buffer, so look at what it didn't see.
+void
+text_session::cmd_done(boost::system::error_code ec, size_t bytes)
+{
+  if (!ec && !cmd_found_)
+    cmd_ready(bytes);
+  callback(ec, bytes);
+}
+
+void
+text_session::skip_done(boost::system::error_code ec, size_t bytes)
+{
+  if (!ec)
+    ibuf.notify_write(bytes);
+  callback(ec, bytes);
+}
+
+void
+text_session::write_done(boost::system::error_code ec, size_t bytes)
+{
+  iov_.clear();
+  release_data();
+  reset_output();
+  callback(ec, bytes);
+}
+
 void
 text_session::callback(boost::system::error_code ec, size_t bytes)
 {
@@ -623,16 +927,15 @@ text_session::callback(boost::system::error_code ec, size_t bytes)
 void
 text_session::loop()
 {
+  gc_unpark();
   bool blocked = false;
   while (not blocked) {
     try {
       switch (state_) {
       case session_write_prompt:
-        obuf.reset();
         blocked = send_prompt();
         continue;
       case session_read_command:
-        obuf.reset();
         blocked = recv_command();
         continue;
       case session_execute_command:
@@ -642,12 +945,15 @@ text_session::loop()
         blocked = dispatch_write();
         continue;
       case session_write_data:
-        obuf.reset();
-        blocked = send_data();
+        set_state(session_execute_command);
+        continue;
+      case session_skip_data:
+        blocked = skip_data();
         continue;
       case session_write_result:
         set_state(session_write_prompt);
-        blocked = flush();
+        if (prompt_ || output_full())
+          blocked = flush();
         continue;
       case session_stopping:
         io_service.dispatch(done_);
@@ -657,6 +963,12 @@ text_session::loop()
       continue;
     } catch (server_error_t) {
       continue;
+    } catch (std::bad_alloc &) {
+      // The cache has freed the value, if there was one.
+      idata_ = NULL;
+      sendln("SERVER_ERROR out of memory");
+      set_state(session_write_result);
+      continue;
     }
     assert(0);
   }
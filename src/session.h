@@ -13,9 +13,23 @@ public:
   virtual void interact(session_done done) = 0;
 };
 
+// Statistics, as reported by the stats command of either protocol.
+class stats_sink
+{
+public:
+  virtual ~stats_sink() { }
+  virtual void stat(const char *name, const char *val) = 0;
+  void stat(const char *name, uint64_t val);
+};
+void report_stats(class cache &c, stats_sink &s);
+void report_slab_stats(stats_sink &s);
+
 session *text_session_new(boost::asio::io_service &io_service,
                           class cache &c, stream &in, stream &out,
                           std::ostream &log, const char *prompt);
+// Binary protocol requests start with this byte, which no text
+// command does.
+constexpr uint8_t binary_request_magic = 0x80;
 session *binary_session_new(boost::asio::io_service &io_service,
                             class cache &c, stream &in, stream &out,
                             std::ostream &log);
@@ -0,0 +1,479 @@
+#include "buffer.h"
+#include "cache.h"
+#include "cpu.h"
+#include "session.h"
+#include "pool.h"
+#include "tcp.h"
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <endian.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Sessions are driven over a socket pair: the server end is served
+// by an io_service on its own thread, the client end is written and
+// read with blocking calls.
+
+static std::ostringstream log_sink;
+
+// Counts the writes a session makes.
+class counting_stream : public stream
+{
+  descriptor_stream s;
+
+public:
+  std::atomic<int> writes{0};
+  counting_stream(boost::asio::posix::stream_descriptor &d) : s(d) { }
+  void async_read(const boost::asio::mutable_buffers_1 &mb,
+                  const complete_t &c, const handler_t &h)
+  {
+    s.async_read(mb, c, h);
+  }
+  void async_write(const boost::asio::const_buffers_1 &cb, const handler_t &h)
+  {
+    writes++;
+    s.async_write(cb, h);
+  }
+  void async_write(const std::vector<boost::asio::const_buffer> &bufs,
+                   const handler_t &h)
+  {
+    writes++;
+    s.async_write(bufs, h);
+  }
+};
+
+// The client end of a connection, with blocking IO.
+class client
+{
+protected:
+  int fd = -1;
+
+public:
+  void send(const std::string &req)
+  {
+    size_t done = 0;
+    while (done < req.size()) {
+      ssize_t n = write(fd, req.data() + done, req.size() - done);
+      assert(n > 0);
+      done += n;
+    }
+  }
+
+  std::string recv(size_t n)
+  {
+    std::string r(n, '\0');
+    size_t done = 0;
+    while (done < n) {
+      ssize_t got = read(fd, &r[done], n - done);
+      assert(got > 0);
+      done += got;
+    }
+    return r;
+  }
+
+  std::string recv_line()
+  {
+    std::string line;
+    while (line.size() < 2 || line.compare(line.size() - 2, 2, "\r\n") != 0)
+      line += recv(1);
+    return line;
+  }
+};
+
+class harness : public client
+{
+  boost::asio::io_service io;
+  int server_fd;
+  std::unique_ptr<boost::asio::posix::stream_descriptor> d;
+  std::unique_ptr<counting_stream> out;
+  std::unique_ptr<session> s;
+  std::thread t;
+
+public:
+  harness(cache &c, bool binary = false)
+  {
+    int fds[2];
+    int r = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(r == 0);
+    (void)r;
+    server_fd = fds[0];
+    fd = fds[1];
+    d.reset(new boost::asio::posix::stream_descriptor(io, server_fd));
+    out.reset(new counting_stream(*d));
+    if (binary)
+      s.reset(binary_session_new(io, c, *out, *out, log_sink));
+    else
+      s.reset(text_session_new(io, c, *out, *out, log_sink, NULL));
+    s->interact([this]() { io.stop(); });
+    t = std::thread([this]() {
+        cpu_init();
+        io.run();
+        cpu_exit();
+      });
+  }
+  ~harness()
+  {
+    close(fd);
+    t.join();
+  }
+
+  // Writes the session made so far. Call once its responses are read.
+  int writes() const { return out->writes; }
+};
+
+static void
+test1()
+{
+  // A multi-get of values too big to copy together with values small
+  // enough to inline fits the output buffer however they're mixed.
+  cache c(64 * 1024 * 1024);
+  harness h(c);
+  std::string keys, expect;
+  for (int i = 0; i < 16; ++i) {
+    std::string k = "key" + std::to_string(i);
+    std::string v(i < 3 ? 1000 : 64, 'a' + i);
+    h.send("set " + k + " 0 0 " + std::to_string(v.size()) + "\r\n" +
+           v + "\r\n");
+    assert(h.recv_line() == "STORED\r\n");
+    keys += " " + k;
+    expect += "VALUE " + k + " 0 " + std::to_string(v.size()) + "\r\n" +
+      v + "\r\n";
+  }
+  expect += "END\r\n";
+  h.send("get" + keys + "\r\n");
+  assert(h.recv(expect.size()) == expect);
+  // And again with each value twice.
+  h.send("get" + keys + keys + "\r\n");
+  std::string values = expect.substr(0, expect.size() - 5);
+  assert(h.recv(2 * values.size() + 5) == values + values + "END\r\n");
+  std::cout << "test1 passed" << std::endl;
+}
+
+static void
+test2()
+{
+  // Responses to pipelined commands go out together, once the input
+  // runs out.
+  cache c(64 * 1024 * 1024);
+  harness h(c);
+  const int n = 50;
+  std::string sets, gets, expect;
+  for (int i = 0; i < n; ++i) {
+    std::string k = "k" + std::to_string(i);
+    sets += "set " + k + " 0 0 1 noreply\r\nx\r\n";
+    gets += "get " + k + "\r\n";
+    expect += "VALUE " + k + " 0 1\r\nx\r\nEND\r\n";
+  }
+  h.send(sets + "get k0\r\n");
+  assert(h.recv_line() == "VALUE k0 0 1\r\n");
+  assert(h.recv(8) == "x\r\nEND\r\n");
+  assert(h.writes() == 1);
+  h.send(gets);
+  assert(h.recv(expect.size()) == expect);
+  assert(h.writes() == 2);
+  // A longer pipeline is flushed as the output buffer fills.
+  gets.clear();
+  expect.clear();
+  for (int i = 0; i < 4 * n; ++i) {
+    std::string k = "k" + std::to_string(i % n);
+    gets += "get " + k + "\r\n";
+    expect += "VALUE " + k + " 0 1\r\nx\r\nEND\r\n";
+  }
+  h.send(gets);
+  assert(h.recv(expect.size()) == expect);
+  assert(h.writes() == 4);
+  // Including counters, whether or not the value is a number.
+  h.send("set n 0 0 2\r\n41\r\nincr n 1\r\nincr k0 1\r\nget n\r\n");
+  expect = "STORED\r\n42\r\n"
+    "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n"
+    "VALUE n 0 2\r\n42\r\nEND\r\n";
+  assert(h.recv(expect.size()) == expect);
+  std::cout << "test2 passed" << std::endl;
+}
+
+// Binary protocol requests and responses, as the client sees them.
+enum {
+  op_get = 0x00, op_set = 0x01, op_increment = 0x05, op_getq = 0x09,
+  op_noop = 0x0a, op_getkq = 0x0d, op_stat = 0x10, op_setq = 0x11,
+};
+enum {
+  status_ok = 0x00, status_key_enoent = 0x01, status_key_eexists = 0x02,
+  status_delta_badval = 0x06,
+};
+
+struct response
+{
+  uint8_t opcode;
+  uint16_t status;
+  uint64_t cas;
+  std::string extras, key, value;
+};
+
+static std::string
+request(uint8_t opcode, const std::string &key,
+        const std::string &extras = "", const std::string &value = "",
+        uint64_t cas = 0)
+{
+  std::string r(24, '\0');
+  r[0] = (char)0x80;
+  r[1] = opcode;
+  uint16_t keylen = htobe16(key.size());
+  memcpy(&r[2], &keylen, 2);
+  r[4] = extras.size();
+  uint32_t body = htobe32(extras.size() + key.size() + value.size());
+  memcpy(&r[8], &body, 4);
+  cas = htobe64(cas);
+  memcpy(&r[16], &cas, 8);
+  return r + extras + key + value;
+}
+
+// Extras for a set: flags and expiry.
+static std::string
+set_extras(uint32_t flags = 0)
+{
+  uint32_t e[2] = { htobe32(flags), 0 };
+  return std::string((const char *)e, sizeof(e));
+}
+
+static response
+recv_response(client &c)
+{
+  std::string h = c.recv(24);
+  assert((uint8_t)h[0] == 0x81);
+  response r;
+  r.opcode = h[1];
+  uint16_t keylen, status;
+  uint32_t body;
+  memcpy(&keylen, &h[2], 2);
+  memcpy(&status, &h[6], 2);
+  memcpy(&body, &h[8], 4);
+  memcpy(&r.cas, &h[16], 8);
+  keylen = be16toh(keylen);
+  r.status = be16toh(status);
+  body = be32toh(body);
+  r.cas = be64toh(r.cas);
+  size_t extlen = (uint8_t)h[4];
+  r.extras = c.recv(extlen);
+  r.key = c.recv(keylen);
+  r.value = c.recv(body - extlen - keylen);
+  return r;
+}
+
+static void
+test3()
+{
+  // Quiet commands answer only what they must, and a noop ends the
+  // batch.
+  cache c(64 * 1024 * 1024);
+  harness h(c, true);
+  h.send(request(op_setq, "a", set_extras(), "apple") +
+         request(op_setq, "b", set_extras(7), "banana") +
+         request(op_getq, "a") +
+         request(op_getkq, "missing") +
+         request(op_getkq, "b") +
+         request(op_noop, ""));
+  response r = recv_response(h);
+  assert(r.opcode == op_getq && r.status == status_ok);
+  assert(r.key.empty() && r.value == "apple" && r.extras.size() == 4);
+  r = recv_response(h);
+  assert(r.opcode == op_getkq && r.key == "b" && r.value == "banana");
+  uint32_t flags;
+  memcpy(&flags, r.extras.data(), 4);
+  assert(be32toh(flags) == 7);
+  r = recv_response(h);
+  assert(r.opcode == op_noop && r.status == status_ok);
+
+  // A cas which doesn't match is refused; one which does is stored.
+  h.send(request(op_get, "a"));
+  uint64_t cas = recv_response(h).cas;
+  h.send(request(op_set, "a", set_extras(), "apricot", cas + 1));
+  assert(recv_response(h).status == status_key_eexists);
+  h.send(request(op_set, "a", set_extras(), "apricot", cas));
+  assert(recv_response(h).status == status_ok);
+  h.send(request(op_set, "missing", set_extras(), "x", cas));
+  assert(recv_response(h).status == status_key_enoent);
+  h.send(request(op_get, "a"));
+  assert(recv_response(h).value == "apricot");
+
+  // Incrementing a value which isn't a number is an error.
+  std::string extras(20, '\0');
+  uint64_t one = htobe64(1);
+  memcpy(&extras[0], &one, 8);
+  h.send(request(op_increment, "a", extras));
+  r = recv_response(h);
+  assert(r.status == status_delta_badval && !r.value.empty());
+  h.send(request(op_get, "a"));
+  assert(recv_response(h).value == "apricot");
+  std::cout << "test3 passed" << std::endl;
+}
+
+static void
+test4()
+{
+  // A value bigger than the buffers is read in pieces and sent from
+  // where it is.
+  cache c(64 * 1024 * 1024);
+  harness h(c, true);
+  std::string value(1536 * 1024, 'v');
+  for (size_t i = 0; i < value.size(); i += 4096)
+    value[i] = 'a' + i / 4096 % 26;
+  h.send(request(op_set, "big", set_extras(), value));
+  assert(recv_response(h).status == status_ok);
+  int writes = h.writes();
+  h.send(request(op_get, "big"));
+  response r = recv_response(h);
+  assert(r.status == status_ok && r.value == value);
+  assert(h.writes() == writes + 1);
+  std::cout << "test4 passed" << std::endl;
+}
+
+static void
+test5()
+{
+  // Stats end with an empty response, and whatever follows them is
+  // answered after it.
+  cache c(64 * 1024 * 1024);
+  harness h(c, true);
+  for (const char *group : { "", "slabs" }) {
+    h.send(request(op_stat, group) + request(op_noop, ""));
+    int n = 0;
+    response r;
+    for (r = recv_response(h); !r.key.empty(); r = recv_response(h)) {
+      assert(r.opcode == op_stat && r.status == status_ok);
+      n++;
+    }
+    assert(n > 0 && r.opcode == op_stat && r.value.empty());
+    assert(recv_response(h).opcode == op_noop);
+  }
+  // Groups we don't keep are not found.
+  h.send(request(op_stat, "items"));
+  response r = recv_response(h);
+  assert(r.opcode == op_stat && r.status == status_key_enoent);
+  std::cout << "test5 passed" << std::endl;
+}
+
+// A TCP connection to the loopback address.
+class tcp_client : public client
+{
+public:
+  tcp_client(int port)
+  {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int r = connect(fd, (sockaddr *)&a, sizeof(a));
+    assert(r == 0);
+    (void)r;
+  }
+  // Wait for the server to close its end.
+  ~tcp_client()
+  {
+    shutdown(fd, SHUT_WR);
+    char c;
+    while (read(fd, &c, 1) > 0)
+      ;
+    close(fd);
+  }
+};
+
+static void
+test6()
+{
+  // The server tells the protocols apart by the first byte.
+  cache c(64 * 1024 * 1024);
+  io_service_pool pool(1);
+  tcp_server *server = nullptr;
+  int port;
+  for (port = 21211; server == nullptr; ++port) {
+    try {
+      server = tcp_server_new(c, log_sink, nullptr, port, 16, pool);
+    } catch (boost::system::system_error &) {
+      assert(port < 21311);
+    }
+  }
+  --port;
+  std::thread t([&]() { pool.run(); });
+  {
+    tcp_client text(port), binary(port);
+    binary.send(request(op_setq, "k", set_extras(), "v") +
+                request(op_noop, ""));
+    assert(recv_response(binary).opcode == op_noop);
+    text.send("get k\r\n");
+    assert(text.recv_line() == "VALUE k 0 1\r\n");
+    assert(text.recv_line() == "v\r\n");
+    assert(text.recv_line() == "END\r\n");
+  }
+  pool.stop();
+  t.join();
+  tcp_server_delete(server);
+  std::cout << "test6 passed" << std::endl;
+}
+
+static void
+test7()
+{
+  // Stats for many slab classes overflow the output buffer.
+  cache c(64 * 1024 * 1024);
+  harness h(c);
+  int n = 0;
+  for (size_t size = 64; size < 512 * 1024; size = size * 5 / 4, ++n) {
+    h.send("set s" + std::to_string(size) + " 0 0 " + std::to_string(size) +
+           " noreply\r\n" + std::string(size, 'x') + "\r\n");
+  }
+  h.send("stats slabs\r\nversion\r\n");
+  int classes = 0;
+  std::string line;
+  while ((line = h.recv_line()) != "END\r\n") {
+    assert(line.compare(0, 5, "STAT ") == 0);
+    if (line.compare(0, 18, "STAT active_slabs ") == 0)
+      classes = std::stoi(line.substr(18));
+  }
+  assert(classes >= n);
+  assert(h.recv_line().compare(0, 8, "VERSION ") == 0);
+  std::cout << "test7 passed" << std::endl;
+}
+
+static void
+test8()
+{
+  // Keys as long as memcached allows are got however many there are,
+  // and longer ones are refused.
+  cache c(64 * 1024 * 1024);
+  harness h(c);
+  std::string keys, expect;
+  // As many as the command line holds, more than a flush's worth.
+  for (int i = 0; i < 15; ++i) {
+    std::string k = std::string(247, 'k') + std::to_string(100 + i);
+    h.send("set " + k + " 0 0 1 noreply\r\nx\r\n");
+    keys += " " + k;
+    expect += "VALUE " + k + " 0 1\r\nx\r\n";
+  }
+  h.send("get" + keys + "\r\n");
+  assert(h.recv(expect.size() + 5) == expect + "END\r\n");
+  h.send("get " + std::string(3990, 'k') + "\r\nversion\r\n");
+  assert(h.recv_line() == "CLIENT ERROR key too long\r\n");
+  assert(h.recv_line() == "\r\n");
+  assert(h.recv_line().compare(0, 8, "VERSION ") == 0);
+  std::cout << "test8 passed" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  test1();
+  test2();
+  test3();
+  test4();
+  test5();
+  test6();
+  test7();
+  test8();
+}
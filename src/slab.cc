@@ -0,0 +1,809 @@
+#include "slab.h"
+#include "numa.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+
+namespace {
+
+constexpr double default_factor = 1.25;
+constexpr size_t default_min_chunk = 48;
+// entry needs 16 byte alignment for cmpxchg16b, and slab_ref
+// reserves the low bit for a tag.
+constexpr size_t chunk_align = 16;
+constexpr int max_classes = 64;
+// Chunks cached per thread and class, moved to and from the shared
+// class in batches of half a magazine.
+constexpr int magazine_size = 32;
+constexpr int magazine_batch = magazine_size / 2;
+constexpr uint32_t page_magic = 0x51ab51ab;
+constexpr size_t small_page = 4096;
+constexpr size_t huge_page = 2 << 20;
+constexpr size_t giant_page = 1 << 30;
+constexpr int large_class = -1;
+constexpr int owned_class = -2;
+
+// Header at the start of every page.
+struct slab_page
+{
+  uint32_t magic;
+  int32_t cls;                  // index into classes, or one of above
+  int32_t node;
+  uint32_t scan;                // free chunks, while reclaiming
+  bool returned;                // free, and its memory given back
+  size_t bytes;                 // mapping size for large allocations
+  const slab_page_owner *owner; // for owned pages
+  slab_page *next_free;         // free page list
+};
+constexpr size_t page_header_size = slab_page_header_size;
+static_assert(sizeof(slab_page) <= page_header_size, "page header");
+
+// Start of a chunk shared by several objects. Objects begin at
+// chunk aligned offsets, so a pointer into a chunk which isn't its
+// start can only be one of them.
+struct shared_header
+{
+  std::atomic<uint32_t> refs;
+  uint32_t start[slab_shared_max]; // object offsets, 0 if unused
+};
+static_assert(sizeof(shared_header) == chunk_align, "shared header");
+
+struct free_chunk
+{
+  free_chunk *next;
+};
+
+// Each node has its own classes, with the same sizes.
+struct slab_class
+{
+  std::mutex lock;
+  size_t chunk_size;
+  size_t chunks_per_page;
+  size_t total_pages;
+  size_t used_chunks;
+  free_chunk *free_list;
+  size_t free_count;
+  char *carve;                  // unused remainder of the newest page
+  size_t carve_left;
+};
+
+// A small per-thread stack of free chunks for each class, so most
+// allocations and frees never touch the shared class.
+struct magazine
+{
+  int count;
+  void *chunks[magazine_size];
+};
+
+void class_refill(int cls, magazine &m);
+void class_flush(int cls, magazine &m, int n);
+
+struct thread_magazines
+{
+  magazine mags[max_classes];
+  bool live = true;
+  ~thread_magazines();
+};
+
+slab_class classes[numa_max_nodes][max_classes];
+int nclasses = 0;
+std::atomic<bool> initialized(false);
+std::once_flag init_once;
+
+// Pages are carved from the region, which is split evenly between
+// nodes when NUMA placement is on.
+struct node_region
+{
+  char *next;
+  char *end;
+  slab_page *free_pages;
+  char *arena;                  // part reserved by slab_reserve()
+  char *arena_end;
+};
+
+std::mutex page_lock;
+node_region regions[numa_max_nodes];
+int nregions = 1;
+size_t region_bytes = 0;
+size_t arena_bytes = 0;
+size_t arena_huge_bytes = 0;
+bool use_huge = false;
+std::atomic<size_t> mapped_bytes(0); // pages in use plus large mappings
+std::atomic<size_t> returned_bytes(0);
+
+thread_local thread_magazines magazines;
+
+}
+
+char *slab_region = nullptr;
+
+namespace {
+
+size_t
+round_up(size_t n, size_t align)
+{
+  return (n + align - 1) / align * align;
+}
+
+// Map bytes of memory aligned to align, slab_page_size by default.
+// Returns nullptr on failure if flags has MAP_NORESERVE, otherwise
+// throws.
+char *
+map_aligned(size_t bytes, size_t align = slab_page_size, int flags = 0)
+{
+  size_t len = bytes + align;
+  void *m = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (m == MAP_FAILED) {
+    if (flags & MAP_NORESERVE)
+      return nullptr;
+    throw std::bad_alloc();
+  }
+  uintptr_t start = (uintptr_t)m;
+  uintptr_t aligned = round_up(start, align);
+  if (aligned > start)
+    munmap(m, aligned - start);
+  uintptr_t end = start + len;
+  if (end > aligned + bytes)
+    munmap((void *)(aligned + bytes), end - (aligned + bytes));
+  return (char *)aligned;
+}
+
+// Map bytes with explicit huge pages (MAP_HUGETLB), which only works
+// if the administrator reserved some. Replaces the mapping at at, if
+// given. Returns nullptr on failure. The pages are reserved but not
+// faulted in, so a NUMA policy can still be applied.
+char *
+map_hugetlb(void *at, size_t bytes, size_t page)
+{
+#ifdef MAP_HUGETLB
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+  if (at)
+    flags |= MAP_FIXED;
+#ifdef MAP_HUGE_SHIFT
+  flags |= __builtin_ctzl(page) << MAP_HUGE_SHIFT;
+#endif
+  void *m = mmap(at, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (m != MAP_FAILED)
+    return (char *)m;
+#endif
+  return nullptr;
+}
+
+// Reserve address space for all slab pages, which is only backed by
+// memory as pages are touched. Asks for the most slab refs can
+// address, settling for less if the system won't allow it.
+void
+map_region()
+{
+  size_t bytes;
+  for (bytes = slab_region_max; bytes >= giant_page; bytes /= 2) {
+    slab_region = map_aligned(bytes, giant_page, MAP_NORESERVE);
+    if (slab_region != nullptr)
+      break;
+  }
+  if (slab_region == nullptr)
+    throw std::bad_alloc();
+  region_bytes = bytes;
+
+  if (numa_enabled())
+    nregions = std::max(1, std::min(numa_nodes(), (int)(bytes / giant_page)));
+  size_t part = bytes / nregions;
+  for (int n = 0; n < nregions; ++n) {
+    regions[n].next = slab_region + n * part;
+    regions[n].end = regions[n].next + part;
+    regions[n].free_pages = nullptr;
+    regions[n].arena = regions[n].arena_end = nullptr;
+    numa_prefer(regions[n].next, part, n);
+  }
+}
+
+// Ask for transparent huge pages on a normal mapping.
+void
+advise_huge(void *p, size_t bytes)
+{
+#ifdef MADV_HUGEPAGE
+  madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+}
+
+void
+prefault(char *p, size_t bytes)
+{
+  for (size_t i = 0; i < bytes; i += small_page)
+    p[i] = 0;
+}
+
+size_t
+map_size(size_t bytes)
+{
+  return round_up(bytes, use_huge ? huge_page : small_page);
+}
+
+// Take a page from a node's part of the region, or nullptr if it is
+// full. Called with page_lock held.
+slab_page *
+node_page(int node)
+{
+  node_region &r = regions[node];
+  slab_page *p = nullptr;
+  if (r.free_pages != nullptr) {
+    p = r.free_pages;
+    r.free_pages = p->next_free;
+  } else if (r.next != r.end) {
+    p = (slab_page *)r.next;
+    r.next += slab_page_size;
+    p->magic = page_magic;
+    p->node = node;
+    p->bytes = slab_page_size;
+  }
+  return p;
+}
+
+// Take a page from the given node, or with node < 0 from the calling
+// thread's node or the next one with room if it is full. Returns
+// nullptr once there is none.
+slab_page *
+page_alloc(int cls, int node = -1)
+{
+  std::unique_lock<std::mutex> l(page_lock);
+  slab_page *p = nullptr;
+  if (node >= 0) {
+    p = node_page(node);
+  } else {
+    int home = numa_node() % nregions;
+    for (int i = 0; i < nregions && p == nullptr; ++i)
+      p = node_page((home + i) % nregions);
+  }
+  l.unlock();
+  if (p == nullptr)
+    return nullptr;
+  mapped_bytes += slab_page_size;
+  p->cls = cls;
+  p->returned = false;
+  return p;
+}
+
+void
+page_release(slab_page *p)
+{
+  mapped_bytes -= slab_page_size;
+  std::lock_guard<std::mutex> l(page_lock);
+  p->next_free = regions[p->node].free_pages;
+  regions[p->node].free_pages = p;
+}
+
+slab_page *
+page_of(const void *p)
+{
+  slab_page *page = (slab_page *)((uintptr_t)p & ~(slab_page_size - 1));
+  assert(page->magic == page_magic);
+  return page;
+}
+
+// Offset of p within its chunk. Non-zero for objects in a shared
+// chunk.
+size_t
+chunk_offset(slab_page *page, const void *p)
+{
+  size_t at = (const char *)p - (const char *)page - page_header_size;
+  return at % classes[0][page->cls].chunk_size;
+}
+
+void
+configure(double factor, size_t min_chunk)
+{
+  assert(factor > 1.0);
+  const size_t max_chunk = slab_page_size - page_header_size;
+  double size = std::max(min_chunk, sizeof(free_chunk));
+  while (nclasses < max_classes - 1 && size <= max_chunk / factor) {
+    size_t chunk = round_up((size_t)size, chunk_align);
+    if (nclasses == 0 || chunk > classes[0][nclasses - 1].chunk_size) {
+      for (int n = 0; n < numa_max_nodes; ++n) {
+        classes[n][nclasses].chunk_size = chunk;
+        classes[n][nclasses].chunks_per_page = max_chunk / chunk;
+      }
+      nclasses++;
+    }
+    size *= factor;
+  }
+  for (int n = 0; n < numa_max_nodes; ++n) {
+    classes[n][nclasses].chunk_size = max_chunk;
+    classes[n][nclasses].chunks_per_page = 1;
+  }
+  nclasses++;
+  map_region();
+  initialized = true;
+}
+
+int
+class_of(size_t size)
+{
+  int lo = 0, hi = nclasses;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (classes[0][mid].chunk_size < size)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void *
+large_alloc(size_t size)
+{
+  size_t bytes = round_up(page_header_size + size, 4096);
+  slab_page *p = (slab_page *)map_aligned(bytes);
+  mapped_bytes += bytes;
+  p->magic = page_magic;
+  p->cls = large_class;
+  p->node = 0;
+  p->bytes = bytes;
+  return (char *)p + page_header_size;
+}
+
+void
+large_free(slab_page *p)
+{
+  mapped_bytes -= p->bytes;
+  munmap(p, p->bytes);
+}
+
+// Remap the start of a node's part of the region as arena. Try 1GB
+// pages, then 2MB pages, and fall back to normal pages with
+// transparent huge pages. Pages already handed out stay put; the
+// arena starts at the next suitably aligned address. Returns the
+// bytes reserved.
+size_t
+reserve_part(node_region &r, int node, size_t bytes)
+{
+  char *a = nullptr;
+  char *at = (char *)round_up((uintptr_t)r.next, giant_page);
+  if (bytes >= giant_page && bytes % giant_page == 0 && at + bytes <= r.end)
+    a = map_hugetlb(at, bytes, giant_page);
+  if (a == nullptr) {
+    at = (char *)round_up((uintptr_t)r.next, huge_page);
+    bytes = std::min(bytes, (size_t)(r.end - at));
+    a = map_hugetlb(at, bytes, huge_page);
+  }
+  if (a != nullptr) {
+    arena_huge_bytes += bytes;
+  } else {
+    // A failed MAP_FIXED may have unmapped the range.
+    a = (char *)mmap(at, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+                     -1, 0);
+    if (a == MAP_FAILED)
+      throw std::bad_alloc();
+    advise_huge(a, bytes);
+  }
+  // The new mapping lost the region's policy; set it again before
+  // faulting anything in.
+  numa_prefer(a, bytes, node);
+  prefault(a, bytes);
+  r.next = r.arena = a;
+  r.arena_end = a + bytes;
+  return bytes;
+}
+
+}
+
+namespace {
+
+// Take a free chunk from node's class, carving a new page from the
+// node's part of the region if need be. Returns nullptr if the node
+// has none left. Called with the class locked.
+void *
+class_take(slab_class &c, int cls, int node)
+{
+  if (c.free_list) {
+    free_chunk *f = c.free_list;
+    c.free_list = f->next;
+    c.free_count--;
+    return f;
+  }
+  if (c.carve_left == 0) {
+    slab_page *p = page_alloc(cls, node);
+    if (p == nullptr)
+      return nullptr;
+    c.carve = (char *)p + page_header_size;
+    c.carve_left = c.chunks_per_page;
+    c.total_pages++;
+  }
+  void *r = c.carve;
+  c.carve += c.chunk_size;
+  c.carve_left--;
+  return r;
+}
+
+// Move a batch of chunks from the thread's node's class to an empty
+// magazine, or as many as are left once the node's part of the region
+// is used up.
+void
+class_refill(int cls, magazine &m)
+{
+  int node = numa_node() % nregions;
+  slab_class &c = classes[node][cls];
+  std::lock_guard<std::mutex> l(c.lock);
+  while (m.count < magazine_batch) {
+    void *r = class_take(c, cls, node);
+    if (r == nullptr)
+      break;
+    m.chunks[m.count++] = r;
+  }
+  c.used_chunks += m.count;
+}
+
+// Take one chunk from another node once the thread's own is full.
+// Magazines only hold chunks from their own node, so it bypasses them
+// and stays accounted to the node it came from.
+void *
+class_alloc_remote(int cls)
+{
+  int home = numa_node() % nregions;
+  for (int i = 1; i < nregions; ++i) {
+    int node = (home + i) % nregions;
+    slab_class &c = classes[node][cls];
+    std::lock_guard<std::mutex> l(c.lock);
+    if (void *r = class_take(c, cls, node)) {
+      c.used_chunks++;
+      return r;
+    }
+  }
+  return nullptr;
+}
+
+// Return the top n chunks of a magazine to the class.
+void
+class_flush(int cls, magazine &m, int n)
+{
+  slab_class &c = classes[numa_node() % nregions][cls];
+  std::lock_guard<std::mutex> l(c.lock);
+  for (int i = 0; i < n; ++i) {
+    free_chunk *f = (free_chunk *)m.chunks[--m.count];
+    f->next = c.free_list;
+    c.free_list = f;
+  }
+  c.free_count += n;
+  c.used_chunks -= n;
+}
+
+// Move pages whose chunks are all on the class's free list to the
+// free page list. Chunks cached in magazines keep their page.
+void
+class_reclaim(slab_class &c)
+{
+  std::lock_guard<std::mutex> l(c.lock);
+  if (c.free_count < c.chunks_per_page)
+    return;
+  slab_page *carving = c.carve_left ? page_of(c.carve) : nullptr;
+  for (free_chunk *f = c.free_list; f; f = f->next)
+    page_of(f)->scan = 0;
+  for (free_chunk *f = c.free_list; f; f = f->next)
+    page_of(f)->scan++;
+
+  // A full page counts on up to twice its chunks as they are unlinked.
+  free_chunk **link = &c.free_list;
+  while (free_chunk *f = *link) {
+    slab_page *page = page_of(f);
+    if (page->scan < c.chunks_per_page || page == carving) {
+      link = &f->next;
+      continue;
+    }
+    *link = f->next;
+    c.free_count--;
+    if (++page->scan == 2 * c.chunks_per_page) {
+      c.total_pages--;
+      page_release(page);
+    }
+  }
+}
+
+thread_magazines::~thread_magazines()
+{
+  for (int i = 0; i < nclasses; ++i)
+    if (mags[i].count)
+      class_flush(i, mags[i], mags[i].count);
+  live = false;
+}
+
+}
+
+void
+slab_init(double factor, size_t min_chunk)
+{
+  std::call_once(init_once, configure, factor, min_chunk);
+}
+
+void *
+slab_alloc(size_t size)
+{
+  if (!initialized.load(std::memory_order_acquire))
+    slab_init(default_factor, default_min_chunk);
+
+  int cls = class_of(size);
+  if (cls == nclasses)
+    return large_alloc(size);
+
+  magazine &m = magazines.mags[cls];
+  if (m.count == 0)
+    class_refill(cls, m);
+  if (m.count == 0) {
+    if (void *r = class_alloc_remote(cls))
+      return r;
+    throw std::bad_alloc();
+  }
+  void *r = m.chunks[--m.count];
+  if (!magazines.live)
+    class_flush(cls, m, m.count);
+  return r;
+}
+
+size_t
+slab_shared_size(const size_t *sizes, int n)
+{
+  assert(n > 0 && n <= slab_shared_max);
+  size_t end = sizeof(shared_header);
+  for (int i = 0; i < n; ++i)
+    end = round_up(end, chunk_align) + sizes[i];
+  return end;
+}
+
+void
+slab_alloc_shared(const size_t *sizes, int n, void **objs)
+{
+  shared_header *h = (shared_header *)slab_alloc(slab_shared_size(sizes, n));
+  assert(page_of(h)->cls >= 0);
+  h->refs = n;
+  size_t end = sizeof(shared_header);
+  for (int i = 0; i < slab_shared_max; ++i) {
+    if (i < n) {
+      h->start[i] = round_up(end, chunk_align);
+      objs[i] = (char *)h + h->start[i];
+      end = h->start[i] + sizes[i];
+    } else {
+      h->start[i] = 0;
+    }
+  }
+}
+
+void
+slab_free(void *p)
+{
+  if (p == nullptr)
+    return;
+  slab_page *page = page_of(p);
+  if (page->cls == large_class)
+    return large_free(page);
+  if (page->cls == owned_class)
+    return page->owner->free(p);
+
+  int cls = page->cls;
+  size_t offset = chunk_offset(page, p);
+  if (offset != 0) {
+    shared_header *h = (shared_header *)((char *)p - offset);
+    if (h->refs.fetch_sub(1) != 1)
+      return;
+    p = h;
+  }
+  if (page->node != numa_node() % nregions) {
+    // Magazines only hold chunks from the thread's own node, so give
+    // this straight back to its node.
+    numa_count_remote_free();
+    slab_class &c = classes[page->node][cls];
+    std::lock_guard<std::mutex> l(c.lock);
+    free_chunk *f = (free_chunk *)p;
+    f->next = c.free_list;
+    c.free_list = f;
+    c.free_count++;
+    c.used_chunks--;
+    return;
+  }
+  magazine &m = magazines.mags[cls];
+  if (!magazines.live) {
+    // Thread is exiting, its magazines are gone.
+    m.chunks[m.count++] = p;
+    return class_flush(cls, m, m.count);
+  }
+  if (m.count == magazine_size)
+    class_flush(cls, m, magazine_batch);
+  m.chunks[m.count++] = p;
+}
+
+// The arena is the next part of the region, remapped in place, split
+// between nodes like the rest of the region.
+void
+slab_reserve(size_t bytes)
+{
+  if (!initialized.load(std::memory_order_acquire))
+    slab_init(default_factor, default_min_chunk);
+  std::lock_guard<std::mutex> l(page_lock);
+  assert(arena_bytes == 0);
+  use_huge = true;
+  bytes = round_up(bytes / nregions, huge_page);
+  for (int n = 0; n < nregions; ++n)
+    arena_bytes += reserve_part(regions[n], n, bytes);
+}
+
+void *
+slab_map(size_t bytes)
+{
+  size_t len = map_size(bytes);
+  char *m = nullptr;
+  if (use_huge)
+    m = map_hugetlb(nullptr, len, huge_page);
+  if (m == nullptr) {
+    m = map_aligned(len);
+    if (use_huge)
+      advise_huge(m, len);
+  }
+  // Every thread probes the whole array, so no node is its home.
+  numa_interleave(m, len);
+  return m;
+}
+
+void
+slab_unmap(void *p, size_t bytes)
+{
+  munmap(p, map_size(bytes));
+}
+
+size_t
+slab_release_free()
+{
+  if (!initialized.load(std::memory_order_acquire))
+    return 0;
+  for (int n = 0; n < nregions; ++n)
+    for (int i = 0; i < nclasses; ++i)
+      class_reclaim(classes[n][i]);
+
+  // The page header stays, to keep the page on the free list. Arena
+  // pages are kept: -L asked for the memory to be preallocated, and
+  // huge pages can't be given back piecemeal anyway.
+  size_t bytes = 0;
+  std::lock_guard<std::mutex> l(page_lock);
+  for (int n = 0; n < nregions; ++n) {
+    node_region &r = regions[n];
+    for (slab_page *p = r.free_pages; p; p = p->next_free) {
+      if (p->returned || ((char *)p >= r.arena && (char *)p < r.arena_end))
+        continue;
+      if (madvise((char *)p + small_page, slab_page_size - small_page,
+                  MADV_DONTNEED) == 0) {
+        p->returned = true;
+        bytes += slab_page_size - small_page;
+      }
+    }
+  }
+  returned_bytes += bytes;
+  return bytes;
+}
+
+size_t
+slab_returned_bytes()
+{
+  return returned_bytes;
+}
+
+size_t
+slab_region_bytes()
+{
+  if (!initialized.load(std::memory_order_acquire))
+    slab_init(default_factor, default_min_chunk);
+  return region_bytes;
+}
+
+size_t
+slab_arena_bytes()
+{
+  return arena_bytes;
+}
+
+size_t
+slab_arena_huge_bytes()
+{
+  return arena_huge_bytes;
+}
+
+size_t
+slab_usable_size(const void *p)
+{
+  slab_page *page = page_of(p);
+  if (page->cls == large_class)
+    return page->bytes;
+  if (page->cls == owned_class)
+    return page->owner->usable_size(p);
+  size_t chunk = classes[0][page->cls].chunk_size;
+  size_t offset = chunk_offset(page, p);
+  if (offset == 0)
+    return chunk;
+
+  // The last object gets the slack at the end of the chunk.
+  const shared_header *h = (const shared_header *)((const char *)p - offset);
+  for (int i = 0; i < slab_shared_max; ++i) {
+    if (h->start[i] != offset)
+      continue;
+    if (i + 1 < slab_shared_max && h->start[i + 1] != 0)
+      return h->start[i + 1] - offset;
+    return chunk - offset;
+  }
+  assert(!"not an object in a shared chunk");
+  return 0;
+}
+
+size_t
+slab_good_size(size_t size)
+{
+  if (!initialized.load(std::memory_order_acquire))
+    slab_init(default_factor, default_min_chunk);
+  int cls = class_of(size);
+  if (cls == nclasses)
+    return round_up(page_header_size + size, small_page);
+  return classes[0][cls].chunk_size;
+}
+
+void *
+slab_page_alloc(const slab_page_owner *owner)
+{
+  slab_page *p = page_alloc(owned_class);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  p->owner = owner;
+  return (char *)p + page_header_size;
+}
+
+void
+slab_page_release(void *data)
+{
+  page_release(page_of(data));
+}
+
+const slab_page_owner *
+slab_page_owner_of(const void *p)
+{
+  slab_page *page = page_of(p);
+  return page->cls == owned_class ? page->owner : nullptr;
+}
+
+void *
+slab_page_data(const void *p)
+{
+  return (char *)page_of(p) + page_header_size;
+}
+
+std::vector<slab_class_stats>
+slab_stats()
+{
+  std::vector<slab_class_stats> r;
+  for (int i = 0; i < nclasses; ++i) {
+    slab_class_stats st = { i + 1, classes[0][i].chunk_size,
+                            classes[0][i].chunks_per_page, 0, 0, 0 };
+    for (int n = 0; n < nregions; ++n) {
+      slab_class &c = classes[n][i];
+      std::lock_guard<std::mutex> l(c.lock);
+      st.total_pages += c.total_pages;
+      st.used_chunks += c.used_chunks;
+      st.free_chunks += c.free_count + c.carve_left;
+    }
+    if (st.total_pages != 0)
+      r.push_back(st);
+  }
+  return r;
+}
+
+int
+slab_node_of(const void *p)
+{
+  return page_of(p)->node;
+}
+
+size_t
+slab_total_malloced()
+{
+  return mapped_bytes;
+}
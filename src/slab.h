@@ -0,0 +1,130 @@
+/* -*-c++-*- */
+/* Slab allocator.
+ *
+ * Small objects (values, entries and keys) are carved out of 1MB
+ * pages, divided into size classes which grow geometrically from a
+ * minimum chunk size, like memcached's -n and -f options. Every page
+ * is aligned to its size, so a chunk can be freed without knowing its
+ * size. Requests larger than the biggest class are mapped directly.
+ *
+ * Each thread keeps a magazine of free chunks per class. Allocations
+ * and frees are served from it, and only move chunks to or from the
+ * shared class, under its lock, in batches. With NUMA placement
+ * (numa.h) every node has its own classes and part of the region, and
+ * threads allocate from their node's.
+ *
+ * All pages are carved from one range of address space reserved up
+ * front, so a chunk can be named by a 32 bit slab_ref.
+ */
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+constexpr size_t slab_page_size = 1 << 20;
+
+// A chunk's offset from the start of the region in 8 byte units. As
+// chunks are 16 byte aligned the low bit is always clear, and free
+// for a tag. Zero is never a chunk, so it stands for nullptr. Large
+// allocations are outside the region and have no ref.
+typedef uint32_t slab_ref;
+constexpr size_t slab_region_max = (size_t)1 << 35; // what refs reach
+extern char *slab_region;
+
+inline slab_ref
+slab_compress(const void *p)
+{
+  if (p == nullptr)
+    return 0;
+  size_t offset = (const char *)p - slab_region;
+  assert(p >= slab_region && offset < slab_region_max && offset % 16 == 0);
+  return offset >> 3;
+}
+
+inline void *
+slab_expand(slab_ref r)
+{
+  return r ? slab_region + ((size_t)r << 3) : nullptr;
+}
+
+// Configure the size classes. Must be called before the first
+// allocation, otherwise the defaults are used.
+void slab_init(double factor, size_t min_chunk);
+
+// Throws std::bad_alloc once the region is used up.
+void *slab_alloc(size_t size);
+void slab_free(void *p);
+// Bytes actually reserved for the chunk containing p.
+size_t slab_usable_size(const void *p);
+// Bytes slab_alloc(size) would reserve.
+size_t slab_good_size(size_t size);
+
+// Several small objects with independent lifetimes can share one
+// chunk, so that they sit in adjacent cache lines. The chunk starts
+// with a reference count and is freed along with the last of them.
+// slab_free() and slab_usable_size() work on each object as usual;
+// the latter reports the object's share of the chunk.
+constexpr int slab_shared_max = 3;
+// Chunk size needed for objects of the given sizes.
+size_t slab_shared_size(const size_t *sizes, int n);
+// Allocate one chunk for n objects, returning their addresses in objs.
+// The total must fit in a size class, not be a large allocation.
+void slab_alloc_shared(const size_t *sizes, int n, void **objs);
+
+struct slab_class_stats
+{
+  int id;
+  size_t chunk_size;
+  size_t chunks_per_page;
+  size_t total_pages;
+  size_t used_chunks;           // including chunks cached by threads
+  size_t free_chunks;
+};
+
+// Whole pages, for allocators layered on the slab (see segment.h).
+// slab_free() and slab_usable_size() on pointers into an owned page
+// are forwarded to its owner.
+struct slab_page_owner
+{
+  void (*free)(void *p);
+  size_t (*usable_size)(const void *p);
+};
+constexpr size_t slab_page_header_size = 64;
+// Returns the page's usable memory, slab_page_data_size bytes long.
+void *slab_page_alloc(const slab_page_owner *owner);
+void slab_page_release(void *data);
+// Usable memory of the owned page containing p.
+void *slab_page_data(const void *p);
+// Owner of the page containing p, or nullptr if not an owned page.
+const slab_page_owner *slab_page_owner_of(const void *p);
+constexpr size_t slab_page_data_size = slab_page_size - slab_page_header_size;
+
+// Reserve an arena of the given size up front, pre-faulted and backed
+// by huge pages when the system allows, and carve slab pages from it
+// before asking the system for more. Call once, before allocating.
+void slab_reserve(size_t bytes);
+// Map memory for large, long lived arrays such as the hash table's
+// buckets. These use huge pages too once slab_reserve() was called.
+void *slab_map(size_t bytes);
+void slab_unmap(void *p, size_t bytes);
+
+// NUMA node whose memory holds p's page (see numa.h).
+int slab_node_of(const void *p);
+
+// Give the memory of free pages back to the system, first freeing
+// pages whose chunks are all free. For the service thread to call now
+// and then; returns the bytes given back.
+size_t slab_release_free();
+// Total bytes given back since startup.
+size_t slab_returned_bytes();
+
+// Classes which have allocated at least one page.
+std::vector<slab_class_stats> slab_stats();
+// Size of the region, which all slab pages come from. Less than
+// slab_region_max if the system wouldn't reserve that much.
+size_t slab_region_bytes();
+// Total bytes mapped for slab pages and large allocations.
+size_t slab_total_malloced();
+// Size of the reserved arena, and how much of it is on huge pages.
+size_t slab_arena_bytes();
+size_t slab_arena_huge_bytes();
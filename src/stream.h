@@ -1,5 +1,6 @@
 #include <boost/asio.hpp>
 #include <functional>
+#include <vector>
 
 class stream
 {
@@ -10,6 +11,9 @@ public:
                           const complete_t &c, const handler_t &h) = 0;
   virtual void async_write(const boost::asio::const_buffers_1 &cb,
                            const handler_t &h) = 0;
+  // Gathered write of all of bufs.
+  virtual void async_write(const std::vector<boost::asio::const_buffer> &bufs,
+                           const handler_t &h) = 0;
 };
 
 class descriptor_stream : public stream
@@ -28,6 +32,11 @@ public:
   {
     boost::asio::async_write(d, cb, h);
   }
+  void async_write(const std::vector<boost::asio::const_buffer> &bufs,
+                   const handler_t &h)
+  {
+    boost::asio::async_write(d, bufs, h);
+  }
 };
 
 class tcp_stream : public stream
@@ -46,4 +55,9 @@ public:
   {
     boost::asio::async_write(s, cb, h);
   }
+  void async_write(const std::vector<boost::asio::const_buffer> &bufs,
+                   const handler_t &h)
+  {
+    boost::asio::async_write(s, bufs, h);
+  }
 };
@@ -2,8 +2,10 @@
 #include <atomic>
 #include <functional>
 #include <cassert>
+#include <new>
 
 #include "counter.h"
+#include "compact_ptr.h"
 
 //static constexpr int
 //fast_log2(size_t s)
@@ -17,7 +19,9 @@ template <class KT, class VT, class KR=const KT&>
 class opentable : public gc_object
 {
 public:
-  typedef flagged_ptr<VT> value_ref;
+  // Keys and values are slab chunks, referenced in 32 bits.
+  typedef compact_ptr<KT> key_ref;
+  typedef compact_ptr<VT> value_ref;
 
 private:
   enum { shared_flag  = 1 };
@@ -25,7 +29,7 @@ private:
   // XXX - normalize to std::function, or more template shit?
   typedef bool (*eq_f)(KR, KR);
   typedef hash_t (*hash_f)(KR, int seed);
-  typedef void (*key_release_f)(KT *);
+  typedef std::function<void (KT *)> key_release_f;
   typedef std::function<void (VT *)> val_release_f;
 
   const int lg2size_;
@@ -41,11 +45,11 @@ private:
 
   class bucket_t {
   public:
-    std::atomic<KT *> k;
+    std::atomic<key_ref> k;
     std::atomic<value_ref> v;
     bucket_t() : k(nullptr), v(nullptr) { }
     ~bucket_t() {
-      KT *kk = k.load(std::memory_order_relaxed);
+      KT *kk = k.load(std::memory_order_relaxed).get_ptr();
       VT *vv = v.load(std::memory_order_relaxed).get_ptr();
       if (kk)
         delete kk;
@@ -54,6 +58,7 @@ private:
     }
   };
 
+  static_assert(sizeof(bucket_t) == 8, "a bucket is one word");
   //enum { entry_size_lg2 = fast_log2(sizeof(bucket_t)); }
   bucket_t *table;
 
@@ -102,6 +107,12 @@ public:
 
   // Find the requested key, or nullptr if it doesn't exist.
   VT *find(KR key) noexcept;
+  // Start loading the first bucket find(key) looks at, so that several
+  // lookups can overlap their cache misses.
+  void prefetch(KR key) const noexcept;
+  // Find the key object stored in the table which is equal to key,
+  // or nullptr if there is none.
+  KT *find_key(KR key) noexcept;
   // Set the given key to the given value. Replaces existing values,
   // Returns true on success.
   KT *set(KT *key, VT *value) noexcept;
@@ -115,6 +126,7 @@ public:
   int lg2size() const { return lg2size_; }
   size_t size() const { return 1ULL << lg2size_; }
   size_t usage() const { return usage_count; }
+  size_t bytes() const { return size() * sizeof(bucket_t); }
 
   KT *set_shared(KT *key, VT *value) noexcept;
   bool add_shared(KT *key, VT *value, KT **cur_key, VT **cur_value) noexcept;
@@ -128,7 +140,7 @@ public:
   public:
     bucket_ref(bucket_t &b) : b(b) { }
     void reset();
-    KT *key() const { return b.k.load(); }
+    KT *key() const { return b.k.load().get_ptr(); }
     VT *value() const { return b.v.load().get_ptr(); }
   };
 
@@ -176,9 +188,13 @@ template<class KT, class VT, class KR>
 opentable<KT,VT,KR>::opentable(int lg2size, eq_f eq, hash_f hash,
                                key_release_f key_release,
                                val_release_f val_release)
-  : lg2size_(lg2size), eq(eq), hash(hash), key_release(key_release),
+  : gc_object(gc_kind_of<opentable>()),
+    lg2size_(lg2size), eq(eq), hash(hash), key_release(key_release),
     val_release(val_release), value_count(0), usage_count(0) {
-  table = new bucket_t[size()];
+  // Buckets are mapped directly, so they can use huge pages.
+  table = static_cast<bucket_t *>(slab_map(size() * sizeof(bucket_t)));
+  for (size_t i = 0; i < size(); ++i)
+    new (&table[i]) bucket_t();
 }
 
 template<class KT, class VT, class KR>
@@ -192,6 +208,24 @@ VT *opentable<KT, VT, KR>::find(KR key) noexcept
   }
 }
 
+template<class KT, class VT, class KR>
+void opentable<KT, VT, KR>::prefetch(KR key) const noexcept
+{
+  hash_t h = hash(key, 0);
+  __builtin_prefetch(&table[h & mask()]);
+}
+
+template<class KT, class VT, class KR>
+KT *opentable<KT, VT, KR>::find_key(KR key) noexcept
+{
+  const bucket_t *b = find_bucket(key);
+  if (b) {
+    return b->k.load().get_ptr();
+  } else {
+    return nullptr;
+  }
+}
+
 // Take exclusive ownership of the given key/value (which were
 // possibly add/set_shared). If these are not present in the table,
 // then free them.
@@ -203,11 +237,12 @@ void opentable<KT, VT, KR>::exclusive(KT *k, VT *v) noexcept
   bucket_t *b = find_bucket(*k);
   if (b == nullptr) {
     key_release(k);
-    val_release(v);
+    if (v != nullptr)
+      val_release(v);
     return;
   }
 
-  if (b->k != k)
+  if (b->k.load().get_ptr() != k)
     key_release(k);
 
   if (v == nullptr)
@@ -221,7 +256,9 @@ void opentable<KT, VT, KR>::exclusive(KT *k, VT *v) noexcept
 template<class KT, class VT, class KR>
 opentable<KT, VT, KR>::~opentable()
 {
-  delete[] table;
+  for (size_t i = 0; i < size(); ++i)
+    table[i].~bucket_t();
+  slab_unmap(table, size() * sizeof(bucket_t));
 }
 
 template<class KT, class VT, class KR>
@@ -272,7 +309,7 @@ auto opentable<KT, VT, KR>::find_bucket(KR key) -> bucket_t *
 {
   bucket_t *found = nullptr;
   iterate_buckets(key, [&](bucket_t &b) {
-      KT *cur = b.k.load();
+      KT *cur = b.k.load().get_ptr();
       if (cur == nullptr) {
         return true;
       } else if (eq(*cur, key)) {
@@ -365,7 +402,7 @@ bool opentable<KT, VT, KR>::iterate_buckets(KR key, F action)
       bits = sizeof(h) * 8;
     }
     i = (i + h) & mask();
-    KT *cur = table[i].k.load();
+    KT *cur = table[i].k.load().get_ptr();
     if (cur == nullptr || eq(key, *cur))
       if (action(table[i]))
         return true;
@@ -378,7 +415,7 @@ bool opentable<KT, VT, KR>::iterate_buckets(KR key, F action)
 template<class KT, class VT, class KR>
 KT *opentable<KT,VT,KR>::set_key(bucket_t &b, KT *key)
 {
-  KT *cur = b.k.load();
+  key_ref cur = b.k.load();
   while (cur == nullptr) {
     if (b.k.compare_exchange_weak(cur, key)) {
       usage_count.incr();
@@ -386,7 +423,7 @@ KT *opentable<KT,VT,KR>::set_key(bucket_t &b, KT *key)
     }
   }
   if (eq(*cur, *key)) {
-    return cur;
+    return cur.get_ptr();
   } else {
     return nullptr;
   }
@@ -442,7 +479,7 @@ template<class KT, class VT, class KR>
 void opentable<KT, VT, KR>::const_iterator::advance()
 {
   for (; ref != end; ++ref) {
-    k = ref->k;
+    k = ref->k.load().get_ptr();
     if (k != nullptr)
       return;
   }
@@ -453,7 +490,7 @@ template<class KT, class VT, class KR>
 void opentable<KT, VT, KR>::iterator::advance()
 {
   for (; ref != end; ++ref) {
-    KT *k = ref->k;
+    KT *k = ref->k.load().get_ptr();
     if (k != nullptr)
       return;
   }
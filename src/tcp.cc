@@ -17,20 +17,38 @@ public:
 
   tcp::socket & socket() { return socket_; }
 
+  // The client's first byte tells which protocol it speaks.
   void interact(session_done done)
   {
     socket_.set_option(tcp::no_delay(true));
-    session_->interact(done);
+    socket_.async_receive(boost::asio::buffer(&first_, 1),
+                          tcp::socket::message_peek,
+                          [this, done](boost::system::error_code ec, size_t) {
+      if (ec) {
+        done();
+        return;
+      }
+      if (first_ == binary_request_magic)
+        session_.reset(binary_session_new(io_service_, cache_,
+                                          stream_, stream_, log_));
+      else
+        session_.reset(text_session_new(io_service_, cache_,
+                                        stream_, stream_, log_, NULL));
+      session_->interact(done);
+    });
   }
 
   tcp_session(io_service& io_service, cache &cache, ostream &log)
-    : socket_(io_service), stream_(socket_),
-      session_(text_session_new(io_service, cache,
-                                stream_, stream_, log, NULL)) { }
+    : io_service_(io_service), cache_(cache), log_(log),
+      socket_(io_service), stream_(socket_) { }
 
 private:
+  io_service &io_service_;
+  cache &cache_;
+  ostream &log_;
   tcp::socket socket_;
   tcp_stream stream_;
+  uint8_t first_;
   std::unique_ptr<session> session_;
 };
 